@@ -0,0 +1,220 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_dispatch.c: Benchmark for dispatching thousands of ready event sources
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * measures the cost of dispatching a ready event source without the cost of
+ * the wait. this is linked against the stub backend, that reports all event
+ * sources as ready on every wait without doing any system call. each count of
+ * event sources is measured with a warm cache and with a cold cache. for the
+ * cold cache a buffer larger than the last level cache is touched before each
+ * iteration. the best of several runs is reported to filter out noise
+ *
+ * usage: event_dispatch [<count> ...]
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "event_stub.h"
+
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "utils.h"
+
+#define ITERATIONS 100
+#define RUNS 7
+#define TRASH_SIZE (32 * 1024 * 1024)
+
+ConfigOption config_options[] = {
+	CONFIG_OPTION_SYMBOL_INITIALIZER("log.level", config_parse_log_level,
+	                                 config_format_log_level, LOG_LEVEL_WARN),
+	CONFIG_OPTION_STRING_INITIALIZER("log.debug_filter", 0, -1, NULL),
+	CONFIG_OPTION_NULL_INITIALIZER
+};
+
+static uint64_t _dispatched = 0;
+static volatile uint8_t *_trash = NULL;
+
+static void handle_read(void *opaque) {
+	(void)opaque;
+
+	++_dispatched;
+}
+
+static void cleanup(void) {
+}
+
+static void trash_cache(void) {
+	int i;
+
+	for (i = 0; i < TRASH_SIZE; i += 64) {
+		++_trash[i];
+	}
+}
+
+// returns the best time per dispatch in nanoseconds, or a negative value on error
+static double measure(int count, bool cold) {
+	double best = -1;
+	double elapsed;
+	uint64_t start;
+	uint64_t total;
+	int run;
+	int i;
+
+	for (run = 0; run < RUNS; ++run) {
+		total = 0;
+		_dispatched = 0;
+
+		for (i = 0; i < ITERATIONS; ++i) {
+			if (cold) {
+				trash_cache();
+			}
+
+			start = microtime();
+
+			if (event_run_once(cleanup, 0) < 0) {
+				return -1;
+			}
+
+			total += microtime() - start;
+		}
+
+		if (_dispatched != (uint64_t)count * ITERATIONS) {
+			fprintf(stderr, "Dispatched %llu instead of %llu event sources\n",
+			        (unsigned long long)_dispatched,
+			        (unsigned long long)count * ITERATIONS);
+
+			return -1;
+		}
+
+		elapsed = total * 1000.0 / ((double)count * ITERATIONS);
+
+		if (best < 0 || elapsed < best) {
+			best = elapsed;
+		}
+	}
+
+	return best;
+}
+
+static int benchmark(int count) {
+	int rc = -1;
+	int i;
+	double warm;
+	double cold;
+
+	for (i = 0; i < count; ++i) {
+		if (event_add_source(EVENT_STUB_FIRST_HANDLE + i, EVENT_SOURCE_TYPE_GENERIC,
+		                     "benchmark", EVENT_READ, handle_read, NULL) < 0) {
+			count = i;
+
+			goto cleanup;
+		}
+	}
+
+	event_cleanup_sources();
+
+	// warm up, this also lets the stub backend shuffle the event sources
+	for (i = 0; i < 3; ++i) {
+		if (event_run_once(cleanup, 0) < 0) {
+			goto cleanup;
+		}
+	}
+
+	warm = measure(count, false);
+	cold = measure(count, true);
+
+	if (warm < 0 || cold < 0) {
+		goto cleanup;
+	}
+
+	printf("%6d ready event sources: %6.1f ns per dispatch (warm cache), %6.1f ns per dispatch (cold cache)\n",
+	       count, warm, cold);
+
+	rc = 0;
+
+cleanup:
+	for (i = 0; i < count; ++i) {
+		event_remove_source(EVENT_STUB_FIRST_HANDLE + i, EVENT_SOURCE_TYPE_GENERIC);
+	}
+
+	event_cleanup_sources();
+
+	return rc;
+}
+
+int main(int argc, char **argv) {
+	static const int default_counts[] = { 1000, 4000, 16000 };
+	int exit_code = EXIT_FAILURE;
+	int count;
+	int i;
+
+	log_init();
+
+	if (event_init() < 0) {
+		goto error_event;
+	}
+
+	_trash = calloc(1, TRASH_SIZE);
+
+	if (_trash == NULL) {
+		fprintf(stderr, "Could not allocate cache trash buffer\n");
+
+		goto error_trash;
+	}
+
+	if (argc > 1) {
+		for (i = 1; i < argc; ++i) {
+			count = atoi(argv[i]);
+
+			if (count <= 0) {
+				fprintf(stderr, "Invalid event source count '%s'\n", argv[i]);
+
+				goto error_benchmark;
+			}
+
+			if (benchmark(count) < 0) {
+				goto error_benchmark;
+			}
+		}
+	} else {
+		for (i = 0; i < (int)(sizeof(default_counts) / sizeof(default_counts[0])); ++i) {
+			if (benchmark(default_counts[i]) < 0) {
+				goto error_benchmark;
+			}
+		}
+	}
+
+	exit_code = EXIT_SUCCESS;
+
+error_benchmark:
+	free((void *)_trash);
+
+error_trash:
+	event_exit();
+
+error_event:
+	log_exit();
+
+	return exit_code;
+}
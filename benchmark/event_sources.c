@@ -0,0 +1,185 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_sources.c: Benchmark for adding, removing and dispatching event sources
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * measures the cost of adding and removing event sources (churn) and the cost
+ * of dispatching ready event sources with the platform backend of the event
+ * loop. all event sources are duplicates of the read end of a pipe that holds
+ * unread data, therefore every event source is ready in every iteration. only
+ * the public event API is used, so the same program can be built against older
+ * versions of event.c to compare the numbers
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "event.h"
+#include "log.h"
+#include "utils.h"
+
+#define SOURCE_COUNT 500
+#define CHURN_ROUNDS 400
+#define DISPATCH_ITERATIONS 2000
+
+ConfigOption config_options[] = {
+	CONFIG_OPTION_SYMBOL_INITIALIZER("log.level", config_parse_log_level,
+	                                 config_format_log_level, LOG_LEVEL_WARN),
+	CONFIG_OPTION_STRING_INITIALIZER("log.debug_filter", 0, -1, NULL),
+	CONFIG_OPTION_NULL_INITIALIZER
+};
+
+static int _handles[SOURCE_COUNT];
+static uint64_t _dispatched = 0;
+static int _iterations = 0;
+static uint64_t _dispatch_start = 0;
+
+static void handle_read(void *opaque) {
+	(void)opaque;
+
+	++_dispatched;
+}
+
+static int add_sources(void) {
+	int i;
+
+	for (i = 0; i < SOURCE_COUNT; ++i) {
+		if (event_add_source(_handles[i], EVENT_SOURCE_TYPE_GENERIC, "benchmark",
+		                     EVENT_READ, handle_read, NULL) < 0) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void remove_sources(void) {
+	int i;
+
+	for (i = 0; i < SOURCE_COUNT; ++i) {
+		event_remove_source(_handles[i], EVENT_SOURCE_TYPE_GENERIC);
+	}
+}
+
+// the first iteration is not measured, it includes the setup of the backend
+static void count_iteration(void) {
+	if (_iterations++ == 0) {
+		_dispatched = 0;
+		_dispatch_start = microtime();
+	} else if (_iterations > DISPATCH_ITERATIONS) {
+		event_stop();
+	}
+}
+
+int main(void) {
+	int exit_code = EXIT_FAILURE;
+	int pipe_handles[2];
+	int i;
+	int round;
+	uint64_t start;
+	uint64_t elapsed;
+
+	log_init();
+
+	if (event_init() < 0) {
+		goto error_event;
+	}
+
+	if (pipe(pipe_handles) < 0) {
+		fprintf(stderr, "Could not create pipe: %s (%d)\n", get_errno_name(errno), errno);
+
+		goto error_pipe;
+	}
+
+	if (write(pipe_handles[1], "x", 1) != 1) {
+		fprintf(stderr, "Could not write to pipe: %s (%d)\n", get_errno_name(errno), errno);
+
+		goto error_handles;
+	}
+
+	for (i = 0; i < SOURCE_COUNT; ++i) {
+		_handles[i] = dup(pipe_handles[0]);
+
+		if (_handles[i] < 0) {
+			fprintf(stderr, "Could not duplicate pipe handle: %s (%d)\n",
+			        get_errno_name(errno), errno);
+
+			goto error_handles;
+		}
+	}
+
+	// churn: add and remove all event sources, the removed event sources are
+	// cleaned up at the end of each round, as the event loop would do
+	start = microtime();
+
+	for (round = 0; round < CHURN_ROUNDS; ++round) {
+		if (add_sources() < 0) {
+			goto error_handles;
+		}
+
+		event_cleanup_sources();
+		remove_sources();
+		event_cleanup_sources();
+	}
+
+	elapsed = microtime() - start;
+
+	printf("churn: %d event sources, %.1f ns per add and remove\n", SOURCE_COUNT,
+	       elapsed * 1000.0 / ((double)CHURN_ROUNDS * SOURCE_COUNT));
+
+	// dispatch: all event sources are ready in every iteration
+	if (add_sources() < 0) {
+		goto error_handles;
+	}
+
+	if (event_run(count_iteration) < 0) {
+		goto error_run;
+	}
+
+	elapsed = microtime() - _dispatch_start;
+
+	printf("dispatch: %d ready event sources, %.1f ns per dispatch including the wait\n",
+	       SOURCE_COUNT, elapsed * 1000.0 / (double)_dispatched);
+
+	exit_code = EXIT_SUCCESS;
+
+error_run:
+	remove_sources();
+	event_cleanup_sources();
+
+error_handles:
+	for (i = 0; i < SOURCE_COUNT && _handles[i] > 0; ++i) {
+		close(_handles[i]);
+	}
+
+	close(pipe_handles[0]);
+	close(pipe_handles[1]);
+
+error_pipe:
+	event_exit();
+
+error_event:
+	log_exit();
+
+	return exit_code;
+}
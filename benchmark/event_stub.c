@@ -0,0 +1,187 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_stub.c: Stub event loop backend for benchmarking the dispatching
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * this backend never waits. each event source with a handle at or above
+ * EVENT_STUB_FIRST_HANDLE is reported as ready for reading on every wait, all
+ * other event sources (e.g. the notifiers of the event loop) are never
+ * reported. the ready event sources are reported in a shuffled order, like a
+ * real backend would report them in an arbitrary order, to keep the hardware
+ * prefetcher from hiding the memory layout of the event sources
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "event_stub.h"
+
+#include "array.h"
+#include "log.h"
+#include "utils.h"
+
+static LogSource _log_source = LOG_SOURCE_INITIALIZER;
+
+typedef struct {
+	Array sources; // EventSource pointers
+	bool shuffled;
+} EventStub;
+
+int event_init_platform(EventLoop *event_loop) {
+	EventStub *platform = calloc(1, sizeof(EventStub));
+
+	if (platform == NULL) {
+		errno = ENOMEM;
+
+		log_error("Could not allocate stub event loop: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	if (array_create(&platform->sources, 32, sizeof(EventSource *), true) < 0) {
+		log_error("Could not create stub event source array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		free(platform);
+
+		return -1;
+	}
+
+	event_loop->platform = platform;
+
+	return 0;
+}
+
+void event_exit_platform(EventLoop *event_loop) {
+	EventStub *platform = event_loop->platform;
+
+	array_destroy(&platform->sources, NULL);
+	free(platform);
+}
+
+int event_source_added_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventStub *platform = event_loop->platform;
+	EventSource **source;
+
+	event_source->platform_slot = -1;
+
+	if (event_source->handle < EVENT_STUB_FIRST_HANDLE) {
+		return 0;
+	}
+
+	source = array_append(&platform->sources);
+
+	if (source == NULL) {
+		log_error("Could not append to stub event source array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	*source = event_source;
+	event_source->platform_slot = platform->sources.count - 1;
+	platform->shuffled = false;
+
+	return 0;
+}
+
+int event_source_modified_platform(EventLoop *event_loop, EventSource *event_source) {
+	(void)event_loop;
+	(void)event_source;
+
+	return 0;
+}
+
+// move the last event source into the slot of the removed one
+void event_source_removed_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventStub *platform = event_loop->platform;
+	EventSource *last_source;
+
+	if (event_source->platform_slot < 0) {
+		return;
+	}
+
+	last_source = *(EventSource **)array_get(&platform->sources, platform->sources.count - 1);
+	*(EventSource **)array_get(&platform->sources, event_source->platform_slot) = last_source;
+	last_source->platform_slot = event_source->platform_slot;
+	event_source->platform_slot = -1;
+
+	array_remove(&platform->sources, platform->sources.count - 1, NULL);
+}
+
+IOHandle event_get_handle_platform(EventLoop *event_loop) {
+	(void)event_loop;
+
+	return IO_HANDLE_INVALID;
+}
+
+int event_flush_platform(EventLoop *event_loop) {
+	(void)event_loop;
+
+	return 0;
+}
+
+// the shuffle uses a fixed seed, every run reports the same order
+int event_wait_platform(EventLoop *event_loop, int timeout, Array *ready_sources) {
+	EventStub *platform = event_loop->platform;
+	EventSource **source;
+	EventSource **other;
+	EventSource *event_source;
+	EventReadySource *ready_source;
+	int i;
+
+	(void)timeout;
+
+	if (!platform->shuffled) {
+		srand(7);
+
+		for (i = platform->sources.count - 1; i > 0; --i) {
+			source = array_get(&platform->sources, i);
+			other = array_get(&platform->sources, rand() % (i + 1));
+			event_source = *source;
+			*source = *other;
+			*other = event_source;
+		}
+
+		for (i = 0; i < platform->sources.count; ++i) {
+			(*(EventSource **)array_get(&platform->sources, i))->platform_slot = i;
+		}
+
+		platform->shuffled = true;
+	}
+
+	for (i = 0; i < platform->sources.count; ++i) {
+		ready_source = array_append(ready_sources);
+
+		if (ready_source == NULL) {
+			log_error("Could not append to ready event source array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		ready_source->event_source = *(EventSource **)array_get(&platform->sources, i);
+		ready_source->received_events = EVENT_READ;
+	}
+
+	return 0;
+}
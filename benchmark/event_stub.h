@@ -0,0 +1,31 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_stub.h: Stub event loop backend for benchmarking the dispatching
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DAEMONLIB_EVENT_STUB_H
+#define DAEMONLIB_EVENT_STUB_H
+
+#include "event.h"
+
+// event sources with a handle at or above this are reported as always ready.
+// such handles don't need to be valid file descriptors
+#define EVENT_STUB_FIRST_HANDLE 100000
+
+#endif // DAEMONLIB_EVENT_STUB_H
@@ -21,29 +21,100 @@
  */
 
 #include <errno.h>
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "event.h"
 
 #include "array.h"
+#include "heap.h"
 #include "log.h"
-#include "pipe.h"
+#include "macros.h"
+#include "notifier.h"
 #include "utils.h"
 
 static LogSource _log_source = LOG_SOURCE_INITIALIZER;
 
-static bool _running;
-static bool _stop_requested;
-static Array _event_sources;
-static Pipe _stop_pipe;
-
-extern int event_init_platform(void);
-extern void event_exit_platform(void);
-extern int event_source_added_platform(EventSource *event_source);
-extern int event_source_modified_platform(EventSource *event_source);
-extern void event_source_removed_platform(EventSource *event_source);
-extern int event_run_platform(Array *sources, bool *running,
-                              EventCleanupFunction cleanup);
+#define EVENT_SOURCE_INDEX_MIN_SIZE 64 // must be a power of 2
+#define EVENT_POOL_SLAB_SIZE 64 // number of objects per slab
+#define EVENT_SOURCE_ALIGNMENT 32 // in bytes, a divisor of the cache line size
+
+STATIC_ASSERT(offsetof(EventSource, handle) <= EVENT_SOURCE_ALIGNMENT, "EventSource has too many hot fields")
+
+// all operations on the posted task queue are sequentially consistent. this
+// allows to reason about the order of clearing the post_pending flag and
+// pushing and popping tasks in a simple way, see event_handle_posted_tasks
+#ifdef _MSC_VER
+	#define event_exchange_task(pointer, value) \
+		((EventTask *)InterlockedExchangePointer((PVOID volatile *)(pointer), (value)))
+	#define event_load_task(pointer) \
+		((EventTask *)InterlockedCompareExchangePointer((PVOID volatile *)(pointer), NULL, NULL))
+	#define event_store_task(pointer, value) \
+		InterlockedExchangePointer((PVOID volatile *)(pointer), (value))
+	#define event_exchange_flag(pointer, value) \
+		InterlockedExchange((LONG volatile *)(pointer), (value))
+#else
+	#define event_exchange_task(pointer, value) \
+		__atomic_exchange_n((pointer), (value), __ATOMIC_SEQ_CST)
+	#define event_load_task(pointer) \
+		__atomic_load_n((pointer), __ATOMIC_SEQ_CST)
+	#define event_store_task(pointer, value) \
+		__atomic_store_n((pointer), (value), __ATOMIC_SEQ_CST)
+	#define event_exchange_flag(pointer, value) \
+		__atomic_exchange_n((pointer), (value), __ATOMIC_SEQ_CST)
+#endif
+
+// the dispatch fields are read by the event watchdog thread. the start time is
+// stored last with release semantics, the other fields only have to be
+// atomic. the name is a plain copy, the fence before it keeps its new bytes
+// from becoming visible before the previous start time got cleared. the
+// Interlocked functions are full barriers, which is stronger than necessary
+// but fine
+#ifdef _MSC_VER
+	#define event_fence_dispatch() MemoryBarrier()
+	#define event_store_dispatch_handle(pointer, value) \
+		InterlockedExchangePointer((PVOID volatile *)(pointer), (PVOID)(value))
+	#define event_store_dispatch_type(pointer, value) \
+		InterlockedExchange((LONG volatile *)(pointer), (LONG)(value))
+	#define event_store_dispatch_start(pointer, value) \
+		InterlockedExchange64((LONG64 volatile *)(pointer), (LONG64)(value))
+#else
+	#define event_fence_dispatch() __atomic_thread_fence(__ATOMIC_RELEASE)
+	#define event_store_dispatch_handle(pointer, value) \
+		__atomic_store_n((pointer), (value), __ATOMIC_RELAXED)
+	#define event_store_dispatch_type(pointer, value) \
+		__atomic_store_n((pointer), (value), __ATOMIC_RELAXED)
+	#define event_store_dispatch_start(pointer, value) \
+		__atomic_store_n((pointer), (value), __ATOMIC_RELEASE)
+#endif
+
+static EventLoop _default_event_loop;
+static THREAD_LOCAL EventLoop *_current_event_loop; // running on this thread
+
+extern int event_init_platform(EventLoop *event_loop);
+extern void event_exit_platform(EventLoop *event_loop);
+extern int event_source_added_platform(EventLoop *event_loop, EventSource *event_source);
+extern int event_source_modified_platform(EventLoop *event_loop, EventSource *event_source);
+extern void event_source_removed_platform(EventLoop *event_loop, EventSource *event_source);
+extern int event_wait_platform(EventLoop *event_loop, int timeout, Array *ready_sources);
+extern IOHandle event_get_handle_platform(EventLoop *event_loop);
+extern int event_flush_platform(EventLoop *event_loop);
+
+// the event functions of an event source added by the event_*_source functions
+typedef struct {
+	EventSource *event_source;
+	EventFunction read;
+	void *read_opaque;
+	EventFunction write;
+	void *write_opaque;
+	EventFunction prio;
+	void *prio_opaque;
+	EventFunction error;
+	void *error_opaque;
+} EventLegacyFunctions;
 
 const char *event_get_source_type_name(EventSourceType type, bool upper) {
 	switch (type) {
@@ -54,478 +125,1795 @@ const char *event_get_source_type_name(EventSourceType type, bool upper) {
 	}
 }
 
-int event_init(void) {
-	int phase = 0;
+// push a task to the MPSC queue of posted tasks. this can be called from any
+// thread. based on Dmitry Vyukov's intrusive MPSC node-based queue
+static void event_push_task(EventLoop *event_loop, EventTask *task) {
+	EventTask *previous;
 
-	log_debug("Initializing event subsystem");
+	task->next = NULL;
 
-	_running = false;
-	_stop_requested = false;
+	previous = event_exchange_task(&event_loop->post_tail, task);
 
-	// create event source array, the EventSource struct is not relocatable
-	// because epoll might store a pointer to it
-	if (array_create(&_event_sources, 32, sizeof(EventSource), false) < 0) {
-		log_error("Could not create event source array: %s (%d)",
-		          get_errno_name(errno), errno);
+	// between the exchange and this store the queue is temporarily cut off
+	// at previous. event_pop_task detects this and treats the queue as empty
+	event_store_task(&previous->next, task);
+}
 
-		goto cleanup;
-	}
+// pop a task from the MPSC queue of posted tasks. this must only be called
+// from the thread running the event loop. returns NULL if the queue is empty
+// or if the next task is still in the process of being pushed
+static EventTask *event_pop_task(EventLoop *event_loop) {
+	EventTask *head = event_loop->post_head;
+	EventTask *next = event_load_task(&head->next);
 
-	phase = 1;
+	if (head == &event_loop->post_stub) {
+		if (next == NULL) {
+			return NULL;
+		}
 
-	if (event_init_platform() < 0) {
-		goto cleanup;
+		event_loop->post_head = next;
+		head = next;
+		next = event_load_task(&head->next);
 	}
 
-	phase = 2;
-
-	// create stop pipe
-	if (pipe_create(&_stop_pipe, PIPE_FLAG_NON_BLOCKING_READ) < 0) {
-		log_error("Could not create stop pipe: %s (%d)",
-		          get_errno_name(errno), errno);
+	if (next != NULL) {
+		event_loop->post_head = next;
 
-		goto cleanup;
+		return head;
 	}
 
-	phase = 3;
-
-	if (event_add_source(_stop_pipe.base.read_handle, EVENT_SOURCE_TYPE_GENERIC,
-	                     "event-stop", EVENT_READ, NULL, NULL) < 0) {
-		goto cleanup;
+	// head is the last task in the queue, unless a push is in progress
+	if (head != event_load_task(&event_loop->post_tail)) {
+		return NULL;
 	}
 
-	phase = 4;
-
-cleanup:
-	switch (phase) { // no breaks, all cases fall through intentionally
-	case 3:
-		pipe_destroy(&_stop_pipe);
-		// fall through
+	// push the stub task behind the last task to be able to pop it
+	event_push_task(event_loop, &event_loop->post_stub);
 
-	case 2:
-		event_exit_platform();
-		// fall through
+	next = event_load_task(&head->next);
 
-	case 1:
-		array_destroy(&_event_sources, NULL);
-		// fall through
+	if (next != NULL) {
+		event_loop->post_head = next;
 
-	default:
-		break;
+		return head;
 	}
 
-	return phase == 4 ? 0 : -1;
+	return NULL;
 }
 
-void event_exit(void) {
-	int i;
-	EventSource *event_source;
+static void event_handle_posted_tasks(void *opaque, uint32_t received_events) {
+	EventLoop *event_loop = opaque;
+	EventTask *task;
+	EventFunction function;
+	void *task_opaque;
 
-	log_debug("Shutting down event subsystem");
+	(void)received_events;
+
+	if (notifier_reset(&event_loop->post_notifier) < 0) {
+		log_error("Could not reset post notifier: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	event_remove_source(_stop_pipe.base.read_handle, EVENT_SOURCE_TYPE_GENERIC);
-	pipe_destroy(&_stop_pipe);
+		return;
+	}
 
-	event_exit_platform();
+	// the flag has to be cleared before the queue is drained. a task that is
+	// pushed after the last successful pop then finds the flag cleared and
+	// signals the post notifier again. this includes a task that makes
+	// event_pop_task return NULL because its push is still in progress
+	event_exchange_flag(&event_loop->post_pending, 0);
 
-	event_cleanup_sources();
+	while ((task = event_pop_task(event_loop)) != NULL) {
+		function = task->function;
+		task_opaque = task->opaque;
 
-	for (i = 0; i < _event_sources.count; ++i) {
-		event_source = array_get(&_event_sources, i);
+		free(task);
 
-		log_warn("Leaking %s event source (handle: %d, name: %s, events: 0x%04X) at index %d",
-		         event_get_source_type_name(event_source->type, false),
-		         event_source->handle, event_source->name, event_source->events, i);
+		function(task_opaque);
 	}
+}
 
-	array_destroy(&_event_sources, NULL);
+// the stop notifier is never reset, it only has to wake up the event loop
+static void event_handle_stop(void *opaque, uint32_t received_events) {
+	(void)opaque;
+	(void)received_events;
 }
 
-static EventSource *event_find_source(int start, int end, IOHandle handle,
-                                      EventSourceType type, int *index) {
-	int i;
-	int step = start < end ? 1 : -1;
-	EventSource *event_source;
+int event_init(void) {
+	log_debug("Initializing event subsystem");
 
-	for (i = start; i != end; i += step) {
-		event_source = array_get(&_event_sources, i);
+	_current_event_loop = NULL;
 
-		if (event_source->handle == handle && event_source->type == type) {
-			if (index != NULL) {
-				*index = i;
-			}
+	return event_loop_create(&_default_event_loop);
+}
 
-			return event_source;
-		}
-	}
+void event_exit(void) {
+	log_debug("Shutting down event subsystem");
 
-	return NULL;
+	event_loop_destroy(&_default_event_loop);
 }
 
-// the event sources array contains tuples (handle, type). each tuple can be
-// in the array only once. trying to add (5, USB) to the array while such a
-// tuple is already in the array is an error. there is one exception from this
-// rule: if a tuple got marked as removed, it is allowed to re-add it even
-// before event_cleanup_sources was called to really remove the tuples that
-// got marked as removed before
-int event_add_source(IOHandle handle, EventSourceType type, const char *name,
-                     uint32_t events, EventFunction function, void *opaque) {
-	int index;
-	EventSource *event_source;
-	EventSource backup;
-
-	event_source = event_find_source(0, _event_sources.count, handle, type, &index);
+EventLoop *event_get_default_loop(void) {
+	return &_default_event_loop;
+}
 
-	if (event_source != NULL) {
-		// readd removed event source
-		if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-			memcpy(&backup, event_source, sizeof(backup));
+EventLoop *event_get_current_loop(void) {
+	return _current_event_loop != NULL ? _current_event_loop : &_default_event_loop;
+}
 
-			event_source->name = name;
-			event_source->events = events;
-			event_source->state = EVENT_SOURCE_STATE_READDED;
+// make the event_*_source functions operate on the given event loop for the
+// calling thread, e.g. to create timers for an event loop before it is started.
+// NULL selects the default event loop. returns the previous event loop
+EventLoop *event_set_current_loop(EventLoop *event_loop) {
+	EventLoop *previous_event_loop = event_get_current_loop();
 
-			if ((events & EVENT_READ) != 0) {
-				event_source->read = function;
-				event_source->read_opaque = opaque;
-			}
+	_current_event_loop = event_loop;
 
-			if ((events & EVENT_WRITE) != 0) {
-				event_source->write = function;
-				event_source->write_opaque = opaque;
-			}
+	return previous_event_loop;
+}
 
-			if ((events & EVENT_PRIO) != 0) {
-				event_source->prio = function;
-				event_source->prio_opaque = opaque;
-			}
+// objects are allocated from slabs of EVENT_POOL_SLAB_SIZE objects each, to
+// avoid a malloc/free per object and to keep objects close to each other in
+// memory. each object starts at a multiple of the alignment. slabs are only
+// freed when the pool is destroyed. returns -1 on error (sets errno) or 0 on
+// success
+static int event_pool_create(EventPool *pool, int item_size, int alignment) {
+	item_size = MAX(item_size, (int)sizeof(void *));
 
-			if ((events & EVENT_ERROR) != 0) {
-				event_source->error = function;
-				event_source->error_opaque = opaque;
-			}
+	pool->item_size = (item_size + alignment - 1) & ~(alignment - 1);
+	pool->alignment = alignment;
+	pool->free_items = NULL;
 
-			if (event_source_added_platform(event_source) < 0) {
-				memcpy(event_source, &backup, sizeof(backup));
+	return array_create(&pool->slabs, 8, sizeof(uint8_t *), true);
+}
 
-				return -1;
-			}
+static void event_pool_destroy(EventPool *pool) {
+	int i;
 
-			log_event_debug("Readded %s event source (handle: %d, name: %s) at index %d",
-			                event_get_source_type_name(type, false), handle, name, index);
+	for (i = 0; i < pool->slabs.count; ++i) {
+		free(*(uint8_t **)array_get(&pool->slabs, i));
+	}
 
-			return 0;
-		}
+	array_destroy(&pool->slabs, NULL);
+}
 
-		log_error("%s event source (handle: %d, name: %s) already added at index %d",
-		          event_get_source_type_name(event_source->type, true),
-		          event_source->handle, event_source->name, index);
+// returns NULL on error (sets errno) or a zeroed object
+static void *event_pool_allocate(EventPool *pool) {
+	uint8_t *slab;
+	uint8_t **appended_slab;
+	uint8_t *items;
+	void *item;
+	int i;
 
-		return -1;
-	} else {
-		// add new event source
-		event_source = array_append(&_event_sources);
+	if (pool->free_items == NULL) {
+		slab = malloc((size_t)pool->item_size * EVENT_POOL_SLAB_SIZE + pool->alignment - 1);
 
-		if (event_source == NULL) {
-			log_error("Could not append to event source array: %s (%d)",
-			          get_errno_name(errno), errno);
+		if (slab == NULL) {
+			errno = ENOMEM;
 
-			return -1;
+			return NULL;
 		}
 
-		event_source->handle = handle;
-		event_source->type = type;
-		event_source->name = name;
-		event_source->events = events;
-		event_source->state = EVENT_SOURCE_STATE_ADDED;
+		appended_slab = array_append(&pool->slabs);
 
-		if ((events & EVENT_READ) != 0) {
-			event_source->read = function;
-			event_source->read_opaque = opaque;
-		}
+		if (appended_slab == NULL) {
+			free(slab);
 
-		if ((events & EVENT_WRITE) != 0) {
-			event_source->write = function;
-			event_source->write_opaque = opaque;
+			return NULL;
 		}
 
-		if ((events & EVENT_PRIO) != 0) {
-			event_source->prio = function;
-			event_source->prio_opaque = opaque;
-		}
+		*appended_slab = slab;
+		items = (uint8_t *)(((uintptr_t)slab + pool->alignment - 1) & ~(uintptr_t)(pool->alignment - 1));
 
-		if ((events & EVENT_ERROR) != 0) {
-			event_source->error = function;
-			event_source->error_opaque = opaque;
+		// link backwards to hand out objects in address order
+		for (i = EVENT_POOL_SLAB_SIZE - 1; i >= 0; --i) {
+			item = items + (size_t)pool->item_size * i;
+			*(void **)item = pool->free_items;
+			pool->free_items = item;
 		}
+	}
 
-		if (event_source_added_platform(event_source) < 0) {
-			array_remove(&_event_sources, _event_sources.count - 1, NULL);
+	item = pool->free_items;
+	pool->free_items = *(void **)item;
 
-			return -1;
-		}
+	memset(item, 0, pool->item_size);
 
-		log_event_debug("Added %s event source (handle: %d, name: %s, events: 0x%04X) at index %d",
-		                event_get_source_type_name(type, false),
-		                handle, name, events, _event_sources.count - 1);
+	return item;
+}
 
-		return 0;
-	}
+static void event_pool_free(EventPool *pool, void *item) {
+	*(void **)item = pool->free_items;
+	pool->free_items = item;
 }
 
-// the events that an event source was added for can be modified
-int event_modify_source(IOHandle handle, EventSourceType type, uint32_t events_to_remove,
-                        uint32_t events_to_add, EventFunction function, void *opaque) {
-	int index;
-	EventSource *event_source;
-	EventSource backup;
+// the last event source is moved into the slot of the removed event source
+static void event_remove_from_sources(EventLoop *event_loop, EventSource *event_source) {
+	int last = event_loop->sources.count - 1;
+	EventSource *last_source = *(EventSource **)array_get(&event_loop->sources, last);
 
-	event_source = event_find_source(0, _event_sources.count, handle, type, &index);
+	*(EventSource **)array_get(&event_loop->sources, event_source->source_slot) = last_source;
+	last_source->source_slot = event_source->source_slot;
 
-	if (event_source == NULL) {
-		log_warn("Could not modify unknown %s event source (handle: %d)",
-		         event_get_source_type_name(type, false), handle);
+	array_remove(&event_loop->sources, last, NULL);
+}
 
-		return -1;
+// record an event source that is not in normal state anymore, so that
+// event_cleanup_sources only has to look at these event sources. if recording
+// fails then event_cleanup_sources falls back to look at all event sources
+static void event_mark_source_dirty(EventLoop *event_loop, EventSource *event_source) {
+	EventSource **dirty_source;
+
+	if (event_source->dirty) {
+		return;
 	}
 
-	if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-		log_error("Cannot modify removed %s event source (handle: %d, name: %s) at index %d",
-		          event_get_source_type_name(type, false), event_source->handle,
-		          event_source->name, index);
+	dirty_source = array_append(&event_loop->dirty_sources);
 
-		return -1;
-	}
+	if (dirty_source == NULL) {
+		log_error("Could not append to dirty event source array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	memcpy(&backup, event_source, sizeof(backup));
+		event_loop->dirty_sources_overflowed = true;
 
-	// modify events bitmask
-	if ((event_source->events & events_to_remove) != events_to_remove) {
-		log_warn("Events to be removed (0x%04X) from %s event source (handle: %d, name: %s) at index %d were not added before",
-		         events_to_remove, event_get_source_type_name(type, false),
-		         event_source->handle, event_source->name, index);
+		return;
 	}
 
-	event_source->events &= ~events_to_remove;
+	*dirty_source = event_source;
+	event_source->dirty = true;
+}
 
-	if ((event_source->events & events_to_add) != 0) {
-		log_warn("Events to be added (0x%04X) to %s event source (handle: %d, name: %s) at index %d are already added",
-		         events_to_add, event_get_source_type_name(type, false),
-		         event_source->handle, event_source->name, index);
-	}
+int event_loop_create(EventLoop *event_loop) {
+	int phase = 0;
 
-	event_source->events |= events_to_add;
+	event_loop->running = false;
+	event_loop->stop_requested = false;
+	event_loop->stats_enabled = false;
+	event_loop->watched = false;
+	event_loop->dispatch_handle = IO_HANDLE_INVALID;
+	event_loop->dispatch_type = EVENT_SOURCE_TYPE_GENERIC;
+	event_loop->dispatch_name[0] = '\0';
+	event_loop->dispatch_start = 0;
+	event_loop->dirty_sources_overflowed = false;
+	event_loop->platform = NULL;
+	event_loop->platform_fallback = false;
+
+	memset(&event_loop->wait_histogram, 0, sizeof(event_loop->wait_histogram));
+	memset(&event_loop->cleanup_histogram, 0, sizeof(event_loop->cleanup_histogram));
+
+	// the queue always contains at least the stub task, this avoids special
+	// handling of the empty queue on the posting side
+	event_loop->post_stub.next = NULL;
+	event_loop->post_head = &event_loop->post_stub;
+	event_loop->post_tail = &event_loop->post_stub;
+	event_loop->post_pending = 0;
+
+	// create event source array. the EventSource struct is not relocatable,
+	// because the platform backends store pointers to it. the event sources
+	// are allocated from a pool and the array only stores pointers to them
+	if (array_create(&event_loop->sources, 32, sizeof(EventSource *), true) < 0) {
+		log_error("Could not create event source array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	// unset functions for removed events
-	if ((events_to_remove & EVENT_READ) != 0) {
-		event_source->read = NULL;
-		event_source->read_opaque = NULL;
+		goto cleanup;
 	}
 
-	if ((events_to_remove & EVENT_WRITE) != 0) {
-		event_source->write = NULL;
-		event_source->write_opaque = NULL;
-	}
+	phase = 1;
 
-	if ((events_to_remove & EVENT_PRIO) != 0) {
-		event_source->prio = NULL;
-		event_source->prio_opaque = NULL;
-	}
+	// create event source pool
+	if (event_pool_create(&event_loop->source_pool, sizeof(EventSource),
+	                      EVENT_SOURCE_ALIGNMENT) < 0) {
+		log_error("Could not create event source pool: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	if ((events_to_remove & EVENT_ERROR) != 0) {
-		event_source->error = NULL;
-		event_source->error_opaque = NULL;
+		goto cleanup;
 	}
 
-	// set functions for added events
-	if ((events_to_add & EVENT_READ) != 0) {
-		event_source->read = function;
-		event_source->read_opaque = opaque;
-	}
+	phase = 2;
 
-	if ((events_to_add & EVENT_WRITE) != 0) {
-		event_source->write = function;
-		event_source->write_opaque = opaque;
+	// create legacy event function pool
+	if (event_pool_create(&event_loop->legacy_pool, sizeof(EventLegacyFunctions),
+	                      (int)sizeof(void *)) < 0) {
+		log_error("Could not create legacy event function pool: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
 	}
 
-	if ((events_to_add & EVENT_PRIO) != 0) {
-		event_source->prio = function;
-		event_source->prio_opaque = opaque;
+	phase = 3;
+
+	// create dirty event source array
+	if (array_create(&event_loop->dirty_sources, 32, sizeof(EventSource *), true) < 0) {
+		log_error("Could not create dirty event source array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
 	}
 
-	if ((events_to_add & EVENT_ERROR) != 0) {
-		event_source->error = function;
-		event_source->error_opaque = opaque;
+	phase = 4;
+
+	// create ready event source array
+	if (array_create(&event_loop->ready_sources, 32, sizeof(EventReadySource), true) < 0) {
+		log_error("Could not create ready event source array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
 	}
 
-	event_source->state = EVENT_SOURCE_STATE_MODIFIED;
+	phase = 5;
 
-	if (event_source_modified_platform(event_source) < 0) {
-		memcpy(event_source, &backup, sizeof(backup));
+	// create yielded event source array
+	if (array_create(&event_loop->yielded_sources, 32, sizeof(EventSource *), true) < 0) {
+		log_error("Could not create yielded event source array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-		return -1;
+		goto cleanup;
 	}
 
-	log_event_debug("Modified (removed: 0x%04X, added: 0x%04X) %s event source (handle: %d, name: %s) at index %d",
-	                events_to_remove, events_to_add,
-	                event_get_source_type_name(type, false), event_source->handle,
-	                event_source->name, index);
+	phase = 6;
 
-	return 0;
-}
+	// create deadline heap
+	if (heap_create(&event_loop->deadlines, 32) < 0) {
+		log_error("Could not create deadline heap: %s (%d)",
+		          get_errno_name(errno), errno);
 
-// only mark event sources as removed here, because the event loop might
-// be in the middle of iterating the event sources array when this function
-// is called
-void event_remove_source(IOHandle handle, EventSourceType type) {
-	int index;
-	EventSource *event_source;
+		goto cleanup;
+	}
 
-	// iterate backwards to remove the last added instance of an event source,
-	// otherwise an remove-add-remove sequence for the same event source between
-	// two calls to event_cleanup_sources doesn't work properly
-	event_source = event_find_source(_event_sources.count - 1, -1, handle, type, &index);
+	phase = 7;
 
-	if (event_source == NULL) {
-		log_warn("Could not mark unknown %s event source (handle: %d) as removed",
-		         event_get_source_type_name(type, false), handle);
+	// create deferred call array
+	if (array_create(&event_loop->deferred_calls, 32, sizeof(EventDeferredCall *), true) < 0) {
+		log_error("Could not create deferred call array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-		return;
+		goto cleanup;
 	}
 
-	if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-		log_warn("%s event source (handle: %d, name: %s, events: 0x%04X) already marked as removed at index %d",
-		         event_get_source_type_name(event_source->type, true),
-		         event_source->handle, event_source->name, event_source->events, index);
-	} else {
-		event_source->state = EVENT_SOURCE_STATE_REMOVED;
+	phase = 8;
 
-		event_source_removed_platform(event_source);
+	// create event source stats array, the EventSourceStats struct is not
+	// relocatable because event sources store a pointer to it
+	if (array_create(&event_loop->source_stats, 32, sizeof(EventSourceStats), false) < 0) {
+		log_error("Could not create event source stats array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-		log_event_debug("Marked %s event source (handle: %d, name: %s, events: 0x%04X) as removed at index %d",
-		                event_get_source_type_name(event_source->type, false),
-		                event_source->handle, event_source->name,
-		                event_source->events, index);
+		goto cleanup;
 	}
-}
 
-// remove event sources that got marked as removed and mark (re-)added event
-// sources as normal
-void event_cleanup_sources(void) {
-	int i;
-	EventSource *event_source;
+	phase = 9;
 
-	// iterate backwards for simpler index handling and to be able to print
-	// the correct index
-	for (i = _event_sources.count - 1; i >= 0; --i) {
-		event_source = array_get(&_event_sources, i);
+	// create event source index
+	event_loop->source_index_size = EVENT_SOURCE_INDEX_MIN_SIZE;
+	event_loop->source_index = calloc(event_loop->source_index_size, sizeof(EventSource *));
 
-		if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-			log_event_debug("Removed %s event source (handle: %d, name: %s, events: 0x%04X) at index %d",
-			                event_get_source_type_name(event_source->type, false),
-			                event_source->handle, event_source->name,
-			                event_source->events, i);
+	if (event_loop->source_index == NULL) {
+		errno = ENOMEM;
 
-			array_remove(&_event_sources, i, NULL);
-		} else {
-			event_source->state = EVENT_SOURCE_STATE_NORMAL;
-		}
+		log_error("Could not create event source index: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
 	}
-}
 
-void event_handle_source(EventSource *event_source, uint32_t received_events) {
-	if (event_source->state != EVENT_SOURCE_STATE_NORMAL) {
-		log_event_debug("Ignoring %s event source (handle: %d, name: %s, received-events: 0x%04X) in state transition",
-		                event_get_source_type_name(event_source->type, false),
-		                event_source->handle, event_source->name, received_events);
+	phase = 10;
 
-		return;
+	if (event_init_platform(event_loop) < 0) {
+		goto cleanup;
 	}
 
-	log_event_debug("Handling %s event source (handle: %d, name: %s, received-events: 0x%04X)",
-	                event_get_source_type_name(event_source->type, false),
-	                event_source->handle, event_source->name, received_events);
+	phase = 11;
 
-	// Here we currently only check if prio and error or read and write have
-	// the same functions. Currently read/write and prio/error are not mixed.
-	// It is probably OK to leave it this way since they never seem to be used
-	// together. For example: On a sysfs gpio value file you can only use
-	// prio/error, while on an eventfd or similar prio/error can't be used.
-	if (event_source->prio != NULL &&
-	    event_source->prio == event_source->error &&
-	    event_source->prio_opaque == event_source->error_opaque) {
-		// prio and error event function are the same, don't call it twice,
-		// only call the prio event function once
-		if ((received_events & (EVENT_PRIO | EVENT_ERROR)) != 0) {
-			event_source->prio(event_source->prio_opaque);
-		}
-	} else if (event_source->read != NULL &&
-	           event_source->read == event_source->write &&
-	           event_source->read_opaque == event_source->write_opaque) {
-		// read and write event function are the same, don't call it twice,
-		// only call the read event function once
-		if ((received_events & (EVENT_READ | EVENT_WRITE)) != 0) {
-			event_source->read(event_source->read_opaque);
-		}
-	} else {
-		if ((received_events & EVENT_READ) != 0 && event_source->read != NULL) {
-			event_source->read(event_source->read_opaque);
-		}
+	// create stop notifier
+	if (notifier_create(&event_loop->stop_notifier) < 0) {
+		log_error("Could not create stop notifier: %s (%d)",
+		          get_errno_name(errno), errno);
 
-		if ((received_events & EVENT_WRITE) != 0 && event_source->write != NULL) {
-			// if the event source got removed in the meantime then don't deliver
-			// the write event anymore
-			if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-				log_debug("Ignoring removed %s event source (handle: %d, name: %s, received-events: 0x%04X)",
-				          event_get_source_type_name(event_source->type, false),
-				          event_source->handle, event_source->name, received_events);
+		goto cleanup;
+	}
 
-				return;
-			}
+	phase = 12;
 
-			event_source->write(event_source->write_opaque);
-		}
+	if (event_loop_add_handler(event_loop, notifier_get_handle(&event_loop->stop_notifier),
+	                           EVENT_SOURCE_TYPE_GENERIC, "event-stop", EVENT_READ,
+	                           event_handle_stop, NULL) < 0) {
+		goto cleanup;
+	}
 
-		if ((received_events & EVENT_PRIO) != 0 && event_source->prio != NULL) {
-			// if the event source got removed in the meantime then don't deliver
-			// the write event anymore
-			if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-				log_debug("Ignoring removed %s event source (handle: %d, name: %s, received-events: 0x%04X)",
-				          event_get_source_type_name(event_source->type, false),
-				          event_source->handle, event_source->name, received_events);
+	event_loop_set_source_priority(event_loop, notifier_get_handle(&event_loop->stop_notifier),
+	                               EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
 
-				return;
-			}
+	phase = 13;
 
-			event_source->prio(event_source->prio_opaque);
-		}
+	// create post notifier
+	if (notifier_create(&event_loop->post_notifier) < 0) {
+		log_error("Could not create post notifier: %s (%d)",
+		          get_errno_name(errno), errno);
 
-		if ((received_events & EVENT_ERROR) != 0 && event_source->error != NULL) {
-			// if the event source got removed in the meantime then don't deliver
-			// the write event anymore
-			if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
-				log_debug("Ignoring removed %s event source (handle: %d, name: %s, received-events: 0x%04X)",
-				          event_get_source_type_name(event_source->type, false),
-				          event_source->handle, event_source->name, received_events);
+		goto cleanup;
+	}
 
-				return;
+	phase = 14;
+
+	if (event_loop_add_handler(event_loop, notifier_get_handle(&event_loop->post_notifier),
+	                           EVENT_SOURCE_TYPE_GENERIC, "event-post", EVENT_READ,
+	                           event_handle_posted_tasks, event_loop) < 0) {
+		goto cleanup;
+	}
+
+	phase = 15;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 14:
+		notifier_destroy(&event_loop->post_notifier);
+		// fall through
+
+	case 13:
+		event_loop_remove_source(event_loop, notifier_get_handle(&event_loop->stop_notifier),
+		                         EVENT_SOURCE_TYPE_GENERIC);
+		// fall through
+
+	case 12:
+		notifier_destroy(&event_loop->stop_notifier);
+		// fall through
+
+	case 11:
+		event_exit_platform(event_loop);
+		// fall through
+
+	case 10:
+		free(event_loop->source_index);
+		// fall through
+
+	case 9:
+		array_destroy(&event_loop->source_stats, NULL);
+		// fall through
+
+	case 8:
+		array_destroy(&event_loop->deferred_calls, NULL);
+		// fall through
+
+	case 7:
+		heap_destroy(&event_loop->deadlines);
+		// fall through
+
+	case 6:
+		array_destroy(&event_loop->yielded_sources, NULL);
+		// fall through
+
+	case 5:
+		array_destroy(&event_loop->ready_sources, NULL);
+		// fall through
+
+	case 4:
+		array_destroy(&event_loop->dirty_sources, NULL);
+		// fall through
+
+	case 3:
+		event_pool_destroy(&event_loop->legacy_pool);
+		// fall through
+
+	case 2:
+		event_pool_destroy(&event_loop->source_pool);
+		// fall through
+
+	case 1:
+		array_destroy(&event_loop->sources, NULL);
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 15 ? 0 : -1;
+}
+
+void event_loop_destroy(EventLoop *event_loop) {
+	int i;
+	EventSource *event_source;
+	EventTask *task;
+	EventDeferredCall *call;
+	int dropped = 0;
+
+	event_loop_remove_source(event_loop, notifier_get_handle(&event_loop->post_notifier),
+	                         EVENT_SOURCE_TYPE_GENERIC);
+	notifier_destroy(&event_loop->post_notifier);
+
+	while ((task = event_pop_task(event_loop)) != NULL) {
+		free(task);
+
+		++dropped;
+	}
+
+	if (dropped > 0) {
+		log_warn("Dropped %d posted but unhandled task(s)", dropped);
+	}
+
+	event_loop_remove_source(event_loop, notifier_get_handle(&event_loop->stop_notifier),
+	                         EVENT_SOURCE_TYPE_GENERIC);
+	notifier_destroy(&event_loop->stop_notifier);
+
+	event_exit_platform(event_loop);
+
+	event_loop_cleanup_sources(event_loop);
+
+	for (i = 0; i < event_loop->sources.count; ++i) {
+		event_source = *(EventSource **)array_get(&event_loop->sources, i);
+
+		log_warn("Leaking %s event source (handle: %d, name: %s, events: 0x%04X) at index %d",
+		         event_get_source_type_name(event_source->type, false),
+		         event_source->handle, event_source->name, event_source->events, i);
+	}
+
+	free(event_loop->source_index);
+
+	if (event_loop->deadlines.nodes.count > 0) {
+		log_warn("Dropping %d scheduled but unexpired deadline(s)",
+		         event_loop->deadlines.nodes.count);
+	}
+
+	for (i = 0; i < event_loop->deadlines.nodes.count; ++i) {
+		containerof(*(HeapNode **)array_get(&event_loop->deadlines.nodes, i),
+		            EventDeadline, heap_node)->event_loop = NULL;
+	}
+
+	dropped = 0;
+
+	for (i = 0; i < event_loop->deferred_calls.count; ++i) {
+		call = *(EventDeferredCall **)array_get(&event_loop->deferred_calls, i);
+
+		if (call != NULL) {
+			call->slot = -1;
+			call->event_loop = NULL;
+
+			++dropped;
+		}
+	}
+
+	if (dropped > 0) {
+		log_warn("Dropped %d deferred but uncalled call(s)", dropped);
+	}
+
+	array_destroy(&event_loop->source_stats, NULL);
+	array_destroy(&event_loop->deferred_calls, NULL);
+	heap_destroy(&event_loop->deadlines);
+	array_destroy(&event_loop->yielded_sources, NULL);
+	array_destroy(&event_loop->ready_sources, NULL);
+	array_destroy(&event_loop->dirty_sources, NULL);
+
+	event_pool_destroy(&event_loop->legacy_pool);
+	event_pool_destroy(&event_loop->source_pool);
+	array_destroy(&event_loop->sources, NULL);
+}
+
+static uint32_t event_hash_source(IOHandle handle, EventSourceType type) {
+	uint64_t key = (uint64_t)handle;
+
+	// fold the handle to 32 bit, a SOCKET is 64 bit in size on Windows x64
+	key ^= key >> 32;
+
+	// multiplicative hashing spreads consecutive handles over all buckets
+	return (((uint32_t)key << 1) ^ (uint32_t)type) * 2654435761u;
+}
+
+static EventSource **event_get_index_bucket(EventLoop *event_loop, IOHandle handle,
+                                            EventSourceType type) {
+	return &event_loop->source_index[event_hash_source(handle, type) & (event_loop->source_index_size - 1)];
+}
+
+// double the number of buckets. if this fails the index just stays at its
+// current size, resulting in longer bucket chains but no loss of function
+static void event_grow_index(EventLoop *event_loop) {
+	uint32_t size = event_loop->source_index_size * 2;
+	EventSource **index = calloc(size, sizeof(EventSource *));
+	EventSource **old_index = event_loop->source_index;
+	uint32_t old_size = event_loop->source_index_size;
+	uint32_t i;
+	EventSource *event_source;
+	EventSource *next;
+	EventSource **bucket;
+
+	if (index == NULL) {
+		errno = ENOMEM;
+
+		log_warn("Could not grow event source index to %u buckets: %s (%d)",
+		         size, get_errno_name(errno), errno);
+
+		return;
+	}
+
+	event_loop->source_index = index;
+	event_loop->source_index_size = size;
+
+	for (i = 0; i < old_size; ++i) {
+		for (event_source = old_index[i]; event_source != NULL; event_source = next) {
+			next = event_source->index_next;
+			bucket = event_get_index_bucket(event_loop, event_source->handle, event_source->type);
+
+			event_source->index_next = *bucket;
+			*bucket = event_source;
+		}
+	}
+
+	free(old_index);
+}
+
+static void event_insert_into_index(EventLoop *event_loop, EventSource *event_source) {
+	EventSource **bucket;
+
+	if (event_loop->sources.count > (int)event_loop->source_index_size) {
+		event_grow_index(event_loop);
+	}
+
+	bucket = event_get_index_bucket(event_loop, event_source->handle, event_source->type);
+
+	event_source->index_next = *bucket;
+	*bucket = event_source;
+}
+
+static void event_remove_from_index(EventLoop *event_loop, EventSource *event_source) {
+	EventSource **link = event_get_index_bucket(event_loop, event_source->handle, event_source->type);
+
+	while (*link != NULL) {
+		if (*link == event_source) {
+			*link = event_source->index_next;
+			event_source->index_next = NULL;
+
+			return;
+		}
+
+		link = &(*link)->index_next;
+	}
+}
+
+// the event source index contains each (handle, type) tuple at most once
+static EventSource *event_find_source(EventLoop *event_loop, IOHandle handle,
+                                      EventSourceType type) {
+	EventSource *event_source = *event_get_index_bucket(event_loop, handle, type);
+
+	while (event_source != NULL) {
+		if (event_source->handle == handle && event_source->type == type) {
+			return event_source;
+		}
+
+		event_source = event_source->index_next;
+	}
+
+	return NULL;
+}
+
+static void event_handle_legacy_functions(void *opaque, uint32_t received_events);
+
+// returns true if the event source got removed or if the legacy event
+// functions got replaced by readding the event source with a handler. in the
+// latter case the legacy event functions are already freed
+static bool event_legacy_functions_detached(EventSource *event_source,
+                                            EventLegacyFunctions *legacy) {
+	return event_source->state == EVENT_SOURCE_STATE_REMOVED ||
+	       event_source->handler != event_handle_legacy_functions ||
+	       event_source->opaque != legacy;
+}
+
+// the event handler of event sources added by the event_*_source functions
+static void event_handle_legacy_functions(void *opaque, uint32_t received_events) {
+	EventLegacyFunctions *legacy = opaque;
+	EventSource *event_source = legacy->event_source;
+
+	// Here we currently only check if prio and error or read and write have
+	// the same functions. Currently read/write and prio/error are not mixed.
+	// It is probably OK to leave it this way since they never seem to be used
+	// together. For example: On a sysfs gpio value file you can only use
+	// prio/error, while on an eventfd or similar prio/error can't be used.
+	if (legacy->prio != NULL &&
+	    legacy->prio == legacy->error &&
+	    legacy->prio_opaque == legacy->error_opaque) {
+		// prio and error event function are the same, don't call it twice,
+		// only call the prio event function once
+		if ((received_events & (EVENT_PRIO | EVENT_ERROR)) != 0) {
+			legacy->prio(legacy->prio_opaque);
+		}
+	} else if (legacy->read != NULL &&
+	           legacy->read == legacy->write &&
+	           legacy->read_opaque == legacy->write_opaque) {
+		// read and write event function are the same, don't call it twice,
+		// only call the read event function once
+		if ((received_events & (EVENT_READ | EVENT_WRITE)) != 0) {
+			legacy->read(legacy->read_opaque);
+		}
+	} else {
+		if ((received_events & EVENT_READ) != 0 && legacy->read != NULL) {
+			legacy->read(legacy->read_opaque);
+		}
+
+		if ((received_events & EVENT_WRITE) != 0) {
+			// if the event source got removed or readded with a handler in
+			// the meantime then don't deliver the write event anymore
+			if (event_legacy_functions_detached(event_source, legacy)) {
+				log_debug("Ignoring removed %s event source (handle: %d, name: %s, received-events: 0x%04X)",
+				          event_get_source_type_name(event_source->type, false),
+				          event_source->handle, event_source->name, received_events);
+
+				return;
+			}
+
+			if (legacy->write != NULL) {
+				legacy->write(legacy->write_opaque);
+			}
+		}
+
+		if ((received_events & EVENT_PRIO) != 0) {
+			// if the event source got removed or readded with a handler in
+			// the meantime then don't deliver the prio event anymore
+			if (event_legacy_functions_detached(event_source, legacy)) {
+				log_debug("Ignoring removed %s event source (handle: %d, name: %s, received-events: 0x%04X)",
+				          event_get_source_type_name(event_source->type, false),
+				          event_source->handle, event_source->name, received_events);
+
+				return;
+			}
+
+			if (legacy->prio != NULL) {
+				legacy->prio(legacy->prio_opaque);
+			}
+		}
+
+		if ((received_events & EVENT_ERROR) != 0) {
+			// if the event source got removed or readded with a handler in
+			// the meantime then don't deliver the error event anymore
+			if (event_legacy_functions_detached(event_source, legacy)) {
+				log_debug("Ignoring removed %s event source (handle: %d, name: %s, received-events: 0x%04X)",
+				          event_get_source_type_name(event_source->type, false),
+				          event_source->handle, event_source->name, received_events);
+
+				return;
+			}
+
+			if (legacy->error != NULL) {
+				legacy->error(legacy->error_opaque);
+			}
+		}
+	}
+}
+
+static void event_set_legacy_functions(EventLegacyFunctions *legacy, uint32_t events,
+                                       EventFunction function, void *opaque) {
+	if ((events & EVENT_READ) != 0) {
+		legacy->read = function;
+		legacy->read_opaque = opaque;
+	}
+
+	if ((events & EVENT_WRITE) != 0) {
+		legacy->write = function;
+		legacy->write_opaque = opaque;
+	}
+
+	if ((events & EVENT_PRIO) != 0) {
+		legacy->prio = function;
+		legacy->prio_opaque = opaque;
+	}
+
+	if ((events & EVENT_ERROR) != 0) {
+		legacy->error = function;
+		legacy->error_opaque = opaque;
+	}
+}
+
+// the event sources array contains tuples (handle, type). each tuple can be
+// in the array only once. trying to add (5, USB) to the array while such a
+// tuple is already in the array is an error. there is one exception from this
+// rule: if a tuple got marked as removed, it is allowed to re-add it even
+// before event_cleanup_sources was called to really remove the tuples that
+// got marked as removed before
+static EventSource *event_add_or_readd_source(EventLoop *event_loop, IOHandle handle,
+                                              EventSourceType type, const char *name,
+                                              uint32_t events, EventHandlerFunction handler,
+                                              void *opaque) {
+	EventSource *event_source;
+	EventSource backup;
+	EventSource **slot;
+
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source != NULL) {
+		// readd removed event source
+		if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
+			memcpy(&backup, event_source, sizeof(backup));
+
+			event_source->name = name;
+			event_source->events = events;
+			event_source->state = EVENT_SOURCE_STATE_READDED;
+			event_source->priority = EVENT_SOURCE_PRIORITY_NORMAL;
+			event_source->handler = handler;
+			event_source->opaque = opaque;
+			event_source->stats = NULL;
+
+			if (event_source_added_platform(event_loop, event_source) < 0) {
+				memcpy(event_source, &backup, sizeof(backup));
+
+				return NULL;
+			}
+
+			// the legacy event functions of the removed event source are
+			// not used anymore if they got replaced
+			if (backup.handler == event_handle_legacy_functions && backup.opaque != opaque) {
+				event_pool_free(&event_loop->legacy_pool, backup.opaque);
 			}
 
-			event_source->error(event_source->error_opaque);
+			event_mark_source_dirty(event_loop, event_source);
+
+			log_event_debug("Readded %s event source (handle: %d, name: %s)",
+			                event_get_source_type_name(type, false), handle, name);
+
+			return event_source;
+		}
+
+		log_error("%s event source (handle: %d, name: %s) already added",
+		          event_get_source_type_name(event_source->type, true),
+		          event_source->handle, event_source->name);
+
+		return NULL;
+	} else {
+		// add new event source
+		event_source = event_pool_allocate(&event_loop->source_pool);
+
+		if (event_source == NULL) {
+			log_error("Could not allocate event source: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return NULL;
+		}
+
+		slot = array_append(&event_loop->sources);
+
+		if (slot == NULL) {
+			log_error("Could not append to event source array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			event_pool_free(&event_loop->source_pool, event_source);
+
+			return NULL;
+		}
+
+		*slot = event_source;
+		event_source->source_slot = event_loop->sources.count - 1;
+
+		event_source->handle = handle;
+		event_source->type = type;
+		event_source->name = name;
+		event_source->events = events;
+		event_source->state = EVENT_SOURCE_STATE_ADDED;
+		event_source->priority = EVENT_SOURCE_PRIORITY_NORMAL;
+		event_source->handler = handler;
+		event_source->opaque = opaque;
+
+		if (event_source_added_platform(event_loop, event_source) < 0) {
+			array_remove(&event_loop->sources, event_loop->sources.count - 1, NULL);
+			event_pool_free(&event_loop->source_pool, event_source);
+
+			return NULL;
+		}
+
+		event_insert_into_index(event_loop, event_source);
+		event_mark_source_dirty(event_loop, event_source);
+
+		log_event_debug("Added %s event source (handle: %d, name: %s, events: 0x%04X) at index %d",
+		                event_get_source_type_name(type, false),
+		                handle, name, events, event_loop->sources.count - 1);
+
+		return event_source;
+	}
+}
+
+// the handler is called once per loop iteration with all received events of
+// the event source
+int event_loop_add_handler(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                           const char *name, uint32_t events, EventHandlerFunction handler,
+                           void *opaque) {
+	return event_add_or_readd_source(event_loop, handle, type, name, events, handler, opaque) != NULL ? 0 : -1;
+}
+
+// the function is called for each of the given events. this is implemented
+// on top of an event handler. a readded event source keeps the functions of
+// its removed predecessor for all events that are not readded
+int event_loop_add_source(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                          const char *name, uint32_t events, EventFunction function,
+                          void *opaque) {
+	EventSource *event_source;
+	EventLegacyFunctions *legacy;
+	EventLegacyFunctions backup;
+	bool allocated = false;
+
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source != NULL && event_source->state == EVENT_SOURCE_STATE_REMOVED &&
+	    event_source->handler == event_handle_legacy_functions) {
+		legacy = event_source->opaque;
+
+		memcpy(&backup, legacy, sizeof(backup));
+	} else {
+		legacy = event_pool_allocate(&event_loop->legacy_pool);
+
+		if (legacy == NULL) {
+			log_error("Could not allocate event functions: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		allocated = true;
+	}
+
+	event_set_legacy_functions(legacy, events, function, opaque);
+
+	event_source = event_add_or_readd_source(event_loop, handle, type, name, events,
+	                                         event_handle_legacy_functions, legacy);
+
+	if (event_source == NULL) {
+		if (allocated) {
+			event_pool_free(&event_loop->legacy_pool, legacy);
+		} else {
+			memcpy(legacy, &backup, sizeof(backup));
+		}
+
+		return -1;
+	}
+
+	legacy->event_source = event_source;
+
+	return 0;
+}
+
+int event_loop_modify_handler(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                              uint32_t events_to_remove, uint32_t events_to_add) {
+	EventSource *event_source;
+	EventSource backup;
+
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source == NULL) {
+		log_warn("Could not modify unknown %s event source (handle: %d)",
+		         event_get_source_type_name(type, false), handle);
+
+		return -1;
+	}
+
+	if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
+		log_error("Cannot modify removed %s event source (handle: %d, name: %s)",
+		          event_get_source_type_name(type, false), event_source->handle,
+		          event_source->name);
+
+		return -1;
+	}
+
+	memcpy(&backup, event_source, sizeof(backup));
+
+	// modify events bitmask
+	if ((event_source->events & events_to_remove) != events_to_remove) {
+		log_warn("Events to be removed (0x%04X) from %s event source (handle: %d, name: %s) were not added before",
+		         events_to_remove, event_get_source_type_name(type, false),
+		         event_source->handle, event_source->name);
+	}
+
+	event_source->events &= ~events_to_remove;
+
+	if ((event_source->events & events_to_add) != 0) {
+		log_warn("Events to be added (0x%04X) to %s event source (handle: %d, name: %s) are already added",
+		         events_to_add, event_get_source_type_name(type, false),
+		         event_source->handle, event_source->name);
+	}
+
+	event_source->events |= events_to_add;
+	event_source->state = EVENT_SOURCE_STATE_MODIFIED;
+
+	// the platform backend might only record the modification here and apply
+	// it later, as the epoll backend does. then this only fails if it cannot
+	// be recorded. if applying it fails later, then the backend reports the
+	// event source as ready with EVENT_ERROR instead
+	if (event_source_modified_platform(event_loop, event_source) < 0) {
+		memcpy(event_source, &backup, sizeof(backup));
+
+		return -1;
+	}
+
+	event_mark_source_dirty(event_loop, event_source);
+
+	log_event_debug("Modified (removed: 0x%04X, added: 0x%04X) %s event source (handle: %d, name: %s)",
+	                events_to_remove, events_to_add,
+	                event_get_source_type_name(type, false), event_source->handle,
+	                event_source->name);
+
+	return 0;
+}
+
+// unknown and removed event sources are reported by event_loop_modify_handler
+int event_loop_modify_source(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                             uint32_t events_to_remove, uint32_t events_to_add,
+                             EventFunction function, void *opaque) {
+	EventSource *event_source;
+	EventLegacyFunctions *legacy = NULL;
+	EventLegacyFunctions backup;
+
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source != NULL && event_source->state != EVENT_SOURCE_STATE_REMOVED) {
+		if (event_source->handler != event_handle_legacy_functions) {
+			log_error("Cannot modify functions of %s event source (handle: %d, name: %s) with handler",
+			          event_get_source_type_name(type, false), event_source->handle,
+			          event_source->name);
+
+			return -1;
+		}
+
+		legacy = event_source->opaque;
+
+		memcpy(&backup, legacy, sizeof(backup));
+
+		// unset functions for removed events, set functions for added events
+		event_set_legacy_functions(legacy, events_to_remove, NULL, NULL);
+		event_set_legacy_functions(legacy, events_to_add, function, opaque);
+	}
+
+	if (event_loop_modify_handler(event_loop, handle, type, events_to_remove, events_to_add) < 0) {
+		if (legacy != NULL) {
+			memcpy(legacy, &backup, sizeof(backup));
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// a removed event source must not be handled again, even if it got yielded
+// before. it might be freed before the next iteration of the event loop
+static void event_drop_yielded_source(EventLoop *event_loop, EventSource *event_source) {
+	int i;
+
+	if (event_source->yielded_events == 0) {
+		return;
+	}
+
+	event_source->yielded_events = 0;
+
+	for (i = 0; i < event_loop->yielded_sources.count; ++i) {
+		if (*(EventSource **)array_get(&event_loop->yielded_sources, i) == event_source) {
+			array_remove(&event_loop->yielded_sources, i, NULL);
+
+			break;
+		}
+	}
+}
+
+// only mark event sources as removed here, because the event loop might
+// be in the middle of iterating the event sources array when this function
+// is called
+void event_loop_remove_source(EventLoop *event_loop, IOHandle handle, EventSourceType type) {
+	EventSource *event_source;
+
+	// an event source that got marked as removed stays in the index until
+	// event_cleanup_sources is called. it is reused if it gets readded in the
+	// meantime, so there is at most one instance of it in the index
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source == NULL) {
+		log_warn("Could not mark unknown %s event source (handle: %d) as removed",
+		         event_get_source_type_name(type, false), handle);
+
+		return;
+	}
+
+	if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
+		log_warn("%s event source (handle: %d, name: %s, events: 0x%04X) already marked as removed",
+		         event_get_source_type_name(event_source->type, true),
+		         event_source->handle, event_source->name, event_source->events);
+	} else {
+		event_source->state = EVENT_SOURCE_STATE_REMOVED;
+
+		event_drop_yielded_source(event_loop, event_source);
+		event_source_removed_platform(event_loop, event_source);
+		event_mark_source_dirty(event_loop, event_source);
+
+		log_event_debug("Marked %s event source (handle: %d, name: %s, events: 0x%04X) as removed",
+		                event_get_source_type_name(event_source->type, false),
+		                event_source->handle, event_source->name,
+		                event_source->events);
+	}
+}
+
+void event_loop_set_source_priority(EventLoop *event_loop, IOHandle handle,
+                                    EventSourceType type, EventSourcePriority priority) {
+	EventSource *event_source;
+
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source == NULL) {
+		log_warn("Could not set priority of unknown %s event source (handle: %d)",
+		         event_get_source_type_name(type, false), handle);
+
+		return;
+	}
+
+	event_source->priority = priority;
+
+	log_event_debug("Set priority of %s event source (handle: %d, name: %s) to %d",
+	                event_get_source_type_name(event_source->type, false),
+	                event_source->handle, event_source->name, priority);
+}
+
+// sets errno on error
+int event_loop_yield_source(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                            uint32_t events) {
+	EventSource *event_source;
+	EventSource **yielded_source;
+
+	event_source = event_find_source(event_loop, handle, type);
+
+	if (event_source == NULL) {
+		log_warn("Could not yield unknown %s event source (handle: %d)",
+		         event_get_source_type_name(type, false), handle);
+
+		errno = ENOENT;
+
+		return -1;
+	}
+
+	if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
+		log_error("Cannot yield removed %s event source (handle: %d, name: %s)",
+		          event_get_source_type_name(type, false), event_source->handle,
+		          event_source->name);
+
+		errno = ENOENT;
+
+		return -1;
+	}
+
+	if (events == 0) {
+		return 0;
+	}
+
+	// an event source is recorded only once, even if it gets yielded multiple
+	// times during the same iteration of the event loop
+	if (event_source->yielded_events == 0) {
+		yielded_source = array_append(&event_loop->yielded_sources);
+
+		if (yielded_source == NULL) {
+			log_error("Could not append to yielded event source array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		*yielded_source = event_source;
+	}
+
+	event_source->yielded_events |= events;
+
+	log_event_debug("Yielded %s event source (handle: %d, name: %s, yielded-events: 0x%04X)",
+	                event_get_source_type_name(event_source->type, false),
+	                event_source->handle, event_source->name,
+	                event_source->yielded_events);
+
+	return 0;
+}
+
+static void event_cleanup_source(EventLoop *event_loop, EventSource *event_source) {
+	event_source->dirty = false;
+
+	if (event_source->state == EVENT_SOURCE_STATE_REMOVED) {
+		log_event_debug("Removed %s event source (handle: %d, name: %s, events: 0x%04X) at index %d",
+		                event_get_source_type_name(event_source->type, false),
+		                event_source->handle, event_source->name,
+		                event_source->events, event_source->source_slot);
+
+		event_remove_from_index(event_loop, event_source);
+		event_remove_from_sources(event_loop, event_source);
+
+		if (event_source->handler == event_handle_legacy_functions) {
+			event_pool_free(&event_loop->legacy_pool, event_source->opaque);
+		}
+
+		event_pool_free(&event_loop->source_pool, event_source);
+	} else {
+		event_source->state = EVENT_SOURCE_STATE_NORMAL;
+	}
+}
+
+// remove event sources that got marked as removed and mark (re-)added and
+// modified event sources as normal. only the recorded dirty event sources
+// are looked at, unless recording a dirty event source failed
+void event_loop_cleanup_sources(EventLoop *event_loop) {
+	int i;
+
+	if (event_loop->dirty_sources_overflowed) {
+		event_loop->dirty_sources_overflowed = false;
+
+		// iterate backwards, because removing an event source moves the
+		// last, already visited event source into its slot
+		for (i = event_loop->sources.count - 1; i >= 0; --i) {
+			event_cleanup_source(event_loop, *(EventSource **)array_get(&event_loop->sources, i));
+		}
+	} else {
+		for (i = 0; i < event_loop->dirty_sources.count; ++i) {
+			event_cleanup_source(event_loop, *(EventSource **)array_get(&event_loop->dirty_sources, i));
+		}
+	}
+
+	array_resize(&event_loop->dirty_sources, 0, NULL);
+}
+
+void event_init_deadline(EventDeadline *deadline, EventFunction function, void *opaque) {
+	heap_init_node(&deadline->heap_node);
+
+	deadline->event_loop = NULL;
+	deadline->function = function;
+	deadline->opaque = opaque;
+}
+
+// a deadline that is already scheduled in this event loop keeps its place in
+// the heap and only gets a new expiry, this cannot fail. a deadline that is
+// scheduled in another event loop has to be cancelled there first.
+// sets errno on error
+int event_loop_schedule_deadline(EventLoop *event_loop, EventDeadline *deadline,
+                                 uint64_t delay) { // microseconds
+	if (deadline->event_loop != NULL && deadline->event_loop != event_loop) {
+		log_error("Cannot schedule deadline (%p) that is scheduled in another event loop",
+		          (void *)deadline);
+
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	if (heap_push(&event_loop->deadlines, &deadline->heap_node, microtime() + delay) < 0) {
+		log_error("Could not append to deadline heap: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	deadline->event_loop = event_loop;
+
+	return 0;
+}
+
+void event_loop_cancel_deadline(EventLoop *event_loop, EventDeadline *deadline) {
+	if (deadline->event_loop == NULL) {
+		return;
+	}
+
+	if (deadline->event_loop != event_loop) {
+		log_error("Cannot cancel deadline (%p) that is scheduled in another event loop",
+		          (void *)deadline);
+
+		return;
+	}
+
+	heap_remove(&event_loop->deadlines, &deadline->heap_node);
+
+	deadline->event_loop = NULL;
+}
+
+// publish the handle, type and name of the event source that is about to be
+// handled for the event watchdog. they are stored before the start time, the
+// watchdog reads them in reverse order. the name is copied, because the event
+// source might be removed and its name freed while the watchdog reads it
+static inline void event_begin_dispatch(EventLoop *event_loop, IOHandle handle,
+                                        EventSourceType type, const char *name) {
+	event_fence_dispatch();
+	event_store_dispatch_handle(&event_loop->dispatch_handle, handle);
+	event_store_dispatch_type(&event_loop->dispatch_type, type);
+	string_copy(event_loop->dispatch_name, sizeof(event_loop->dispatch_name), name, -1);
+	event_store_dispatch_start(&event_loop->dispatch_start, microtime());
+}
+
+static inline void event_end_dispatch(EventLoop *event_loop) {
+	event_store_dispatch_start(&event_loop->dispatch_start, 0);
+}
+
+// returns the wait timeout in milliseconds for the earliest deadline, rounded
+// up to never wake up before it. returns -1 if no deadline is scheduled
+static int event_get_deadline_timeout(EventLoop *event_loop) {
+	HeapNode *node;
+	uint64_t now;
+	uint64_t expiry;
+
+	node = heap_peek(&event_loop->deadlines);
+
+	if (node == NULL) {
+		return -1;
+	}
+
+	now = microtime();
+	expiry = node->key;
+
+	if (expiry <= now) {
+		return 0;
+	}
+
+	if (expiry - now > INT32_MAX * (uint64_t)1000) {
+		return INT32_MAX;
+	}
+
+	return (int)((expiry - now + 999) / 1000);
+}
+
+void event_init_deferred_call(EventDeferredCall *call, EventFunction function, void *opaque) {
+	call->slot = -1;
+	call->event_loop = NULL;
+	call->function = function;
+	call->opaque = opaque;
+}
+
+// sets errno on error
+int event_loop_defer_call(EventLoop *event_loop, EventDeferredCall *call) {
+	EventDeferredCall **deferred_call;
+
+	if (call->event_loop == event_loop) {
+		return 0;
+	}
+
+	if (call->event_loop != NULL) {
+		log_error("Cannot defer call (%p) that is deferred in another event loop",
+		          (void *)call);
+
+		errno = EINVAL;
+
+		return -1;
+	}
+
+	deferred_call = array_append(&event_loop->deferred_calls);
+
+	if (deferred_call == NULL) {
+		log_error("Could not append to deferred call array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	*deferred_call = call;
+	call->slot = event_loop->deferred_calls.count - 1;
+	call->event_loop = event_loop;
+
+	return 0;
+}
+
+// the slot is cleared instead of removed to keep the order of the other calls
+void event_loop_cancel_deferred_call(EventLoop *event_loop, EventDeferredCall *call) {
+	if (call->event_loop == NULL) {
+		return;
+	}
+
+	if (call->event_loop != event_loop) {
+		log_error("Cannot cancel call (%p) that is deferred in another event loop",
+		          (void *)call);
+
+		return;
+	}
+
+	*(EventDeferredCall **)array_get(&event_loop->deferred_calls, call->slot) = NULL;
+	call->slot = -1;
+	call->event_loop = NULL;
+}
+
+// call the functions of all calls that were deferred before this function was
+// called, in the order they were deferred. calls deferred in the meantime are
+// moved to the front, they are called in the next iteration
+static void event_handle_deferred_calls(EventLoop *event_loop) {
+	Array *deferred_calls = &event_loop->deferred_calls;
+	int count = deferred_calls->count;
+	int i;
+	EventDeferredCall *call;
+
+	for (i = 0; i < count; ++i) {
+		call = *(EventDeferredCall **)array_get(deferred_calls, i);
+
+		if (call == NULL) {
+			continue;
+		}
+
+		call->slot = -1;
+		call->event_loop = NULL;
+
+		if (event_loop->watched) {
+			event_begin_dispatch(event_loop, IO_HANDLE_INVALID, EVENT_SOURCE_TYPE_GENERIC,
+			                     "<deferred call>");
+		}
+
+		call->function(call->opaque);
+
+		if (event_loop->watched) {
+			event_end_dispatch(event_loop);
+		}
+	}
+
+	for (i = count; i < deferred_calls->count; ++i) {
+		call = *(EventDeferredCall **)array_get(deferred_calls, i);
+		*(EventDeferredCall **)array_get(deferred_calls, i - count) = call;
+
+		if (call != NULL) {
+			call->slot = i - count;
+		}
+	}
+
+	array_resize(deferred_calls, deferred_calls->count - count, NULL);
+}
+
+// returns the timeout in milliseconds that the event loop would wait for if
+// none of its event sources becomes ready, or -1 if it would wait forever.
+// don't block if yielded event sources have work remaining or calls are
+// deferred, but still look for ready event sources to handle them in the same
+// iteration
+int event_loop_get_timeout(EventLoop *event_loop) {
+	if (event_loop->yielded_sources.count > 0 || event_loop->deferred_calls.count > 0) {
+		return 0;
+	}
+
+	return event_get_deadline_timeout(event_loop);
+}
+
+// call the functions of all expired deadlines. a function might schedule or
+// cancel any deadline, including its own
+static void event_handle_deadlines(EventLoop *event_loop) {
+	uint64_t now = microtime();
+	HeapNode *node;
+	EventDeadline *deadline;
+
+	while (event_loop->running) {
+		node = heap_peek(&event_loop->deadlines);
+
+		if (node == NULL || node->key > now) {
+			break;
+		}
+
+		deadline = containerof(node, EventDeadline, heap_node);
+
+		heap_remove(&event_loop->deadlines, node);
+
+		deadline->event_loop = NULL;
+
+		if (event_loop->watched) {
+			event_begin_dispatch(event_loop, IO_HANDLE_INVALID, EVENT_SOURCE_TYPE_GENERIC,
+			                     "<deadline>");
+		}
+
+		deadline->function(deadline->opaque);
+
+		if (event_loop->watched) {
+			event_end_dispatch(event_loop);
+		}
+	}
+}
+
+int event_add_source(IOHandle handle, EventSourceType type, const char *name,
+                     uint32_t events, EventFunction function, void *opaque) {
+	return event_loop_add_source(event_get_current_loop(), handle, type, name,
+	                             events, function, opaque);
+}
+
+int event_add_handler(IOHandle handle, EventSourceType type, const char *name,
+                      uint32_t events, EventHandlerFunction handler, void *opaque) {
+	return event_loop_add_handler(event_get_current_loop(), handle, type, name,
+	                              events, handler, opaque);
+}
+
+int event_modify_handler(IOHandle handle, EventSourceType type, uint32_t events_to_remove,
+                         uint32_t events_to_add) {
+	return event_loop_modify_handler(event_get_current_loop(), handle, type,
+	                                 events_to_remove, events_to_add);
+}
+
+int event_modify_source(IOHandle handle, EventSourceType type, uint32_t events_to_remove,
+                        uint32_t events_to_add, EventFunction function, void *opaque) {
+	return event_loop_modify_source(event_get_current_loop(), handle, type,
+	                                events_to_remove, events_to_add, function, opaque);
+}
+
+void event_remove_source(IOHandle handle, EventSourceType type) {
+	event_loop_remove_source(event_get_current_loop(), handle, type);
+}
+
+void event_set_source_priority(IOHandle handle, EventSourceType type,
+                               EventSourcePriority priority) {
+	event_loop_set_source_priority(event_get_current_loop(), handle, type, priority);
+}
+
+// sets errno on error
+int event_yield_source(IOHandle handle, EventSourceType type, uint32_t events) {
+	return event_loop_yield_source(event_get_current_loop(), handle, type, events);
+}
+
+void event_cleanup_sources(void) {
+	event_loop_cleanup_sources(event_get_current_loop());
+}
+
+// sets errno on error
+int event_schedule_deadline(EventDeadline *deadline, uint64_t delay) { // microseconds
+	return event_loop_schedule_deadline(event_get_current_loop(), deadline, delay);
+}
+
+void event_cancel_deadline(EventDeadline *deadline) {
+	event_loop_cancel_deadline(event_get_current_loop(), deadline);
+}
+
+// sets errno on error
+int event_defer_call(EventDeferredCall *call) {
+	return event_loop_defer_call(event_get_current_loop(), call);
+}
+
+void event_cancel_deferred_call(EventDeferredCall *call) {
+	event_loop_cancel_deferred_call(event_get_current_loop(), call);
+}
+
+// sets errno on error
+int event_post(EventFunction function, void *opaque) {
+	return event_loop_post(event_get_current_loop(), function, opaque);
+}
+
+void event_handle_source(EventSource *event_source, uint32_t received_events) {
+	if (event_source->state != EVENT_SOURCE_STATE_NORMAL) {
+		log_event_debug("Ignoring %s event source (handle: %d, name: %s, received-events: 0x%04X) in state transition",
+		                event_get_source_type_name(event_source->type, false),
+		                event_source->handle, event_source->name, received_events);
+
+		return;
+	}
+
+	log_event_debug("Handling %s event source (handle: %d, name: %s, received-events: 0x%04X)",
+	                event_get_source_type_name(event_source->type, false),
+	                event_source->handle, event_source->name, received_events);
+
+	event_source->handler(event_source->opaque, received_events);
+}
+
+// record the duration since the given start time in the histogram. returns
+// the end time to allow chaining of consecutive measurements
+static uint64_t event_record_duration(EventHistogram *histogram, uint64_t start) {
+	uint64_t end = microtime();
+	uint64_t duration = end - start;
+	int bucket = 0;
+
+	while (bucket < EVENT_HISTOGRAM_BUCKET_COUNT - 1 && duration >= ((uint64_t)1 << bucket)) {
+		++bucket;
+	}
+
+	++histogram->buckets[bucket];
+	++histogram->count;
+	histogram->total += duration;
+
+	if (histogram->max < duration) {
+		histogram->max = duration;
+	}
+
+	return end;
+}
+
+// event sources with the same type and name share their stats. returns NULL
+// if new stats could not be allocated
+static EventSourceStats *event_get_source_stats(EventLoop *event_loop, EventSource *event_source) {
+	const char *name = event_source->name != NULL ? event_source->name : "<unnamed>";
+	int i;
+	EventSourceStats *source_stats;
+
+	if (event_source->stats != NULL) {
+		return event_source->stats;
+	}
+
+	for (i = 0; i < event_loop->source_stats.count; ++i) {
+		source_stats = array_get(&event_loop->source_stats, i);
+
+		if (source_stats->type == event_source->type &&
+		    strncmp(source_stats->name, name, sizeof(source_stats->name) - 1) == 0) {
+			event_source->stats = source_stats;
+
+			return source_stats;
+		}
+	}
+
+	source_stats = array_append(&event_loop->source_stats);
+
+	if (source_stats == NULL) {
+		log_error("Could not append to event source stats array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return NULL;
+	}
+
+	memset(source_stats, 0, sizeof(EventSourceStats));
+
+	source_stats->type = event_source->type;
+
+	string_copy(source_stats->name, sizeof(source_stats->name), name, -1);
+
+	event_source->stats = source_stats;
+
+	return source_stats;
+}
+
+// append the yielded event sources to the ready event sources. an event
+// source that is ready and yielded is only handled once for all events
+static int event_add_yielded_sources(EventLoop *event_loop, Array *ready_sources) {
+	int i;
+	int count = ready_sources->count;
+	EventReadySource *ready_source;
+	EventSource *event_source;
+
+	for (i = 0; i < count; ++i) {
+		ready_source = array_get(ready_sources, i);
+		event_source = ready_source->event_source;
+
+		ready_source->received_events |= event_source->yielded_events;
+		event_source->yielded_events = 0;
+	}
+
+	for (i = 0; i < event_loop->yielded_sources.count; ++i) {
+		event_source = *(EventSource **)array_get(&event_loop->yielded_sources, i);
+
+		if (event_source->yielded_events == 0) {
+			continue;
+		}
+
+		ready_source = array_append(ready_sources);
+
+		if (ready_source == NULL) {
+			log_error("Could not append to ready event source array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
 		}
+
+		ready_source->event_source = event_source;
+		ready_source->received_events = event_source->yielded_events;
+
+		event_source->yielded_events = 0;
 	}
+
+	array_resize(&event_loop->yielded_sources, 0, NULL);
+
+	return 0;
 }
 
-int event_run(EventCleanupFunction cleanup) {
-	int rc;
+// move the ready event sources of high priority to the front, keeping their
+// order. the order of the other ready event sources is not preserved
+static void event_prioritize_ready_sources(Array *ready_sources) {
+	int i;
+	int high = 0;
+	EventReadySource *ready_source;
+	EventReadySource *first_normal;
+	EventReadySource swap;
+
+	for (i = 0; i < ready_sources->count; ++i) {
+		ready_source = array_get(ready_sources, i);
+
+		if (ready_source->event_source->priority != EVENT_SOURCE_PRIORITY_HIGH) {
+			continue;
+		}
+
+		if (i > high) {
+			first_normal = array_get(ready_sources, high);
+
+			memcpy(&swap, first_normal, sizeof(swap));
+			memcpy(first_normal, ready_source, sizeof(swap));
+			memcpy(ready_source, &swap, sizeof(swap));
+		}
+
+		++high;
+	}
+}
+
+// wait for ready event sources, handle them and cleanup afterwards. stats is
+// a constant at each call site, the compiler removes all time measurements
+// from the variant that is used while stats are disabled
+static inline int event_loop_iterate(EventLoop *event_loop, EventCleanupFunction cleanup,
+                                     int timeout, bool stats) {
+	Array *ready_sources = &event_loop->ready_sources;
+	int own_timeout = event_loop_get_timeout(event_loop);
+	int i;
+	EventReadySource *ready_source;
+	EventSourceStats *source_stats = NULL;
+	uint64_t timestamp = 0;
+
+	array_resize(ready_sources, 0, NULL);
+
+	if (stats) {
+		timestamp = microtime();
+	}
+
+	if (timeout < 0 || (own_timeout >= 0 && own_timeout < timeout)) {
+		timeout = own_timeout;
+	}
+
+	if (event_wait_platform(event_loop, timeout, ready_sources) < 0) {
+		return -1;
+	}
+
+	if (stats) {
+		timestamp = event_record_duration(&event_loop->wait_histogram, timestamp);
+	}
+
+	if (event_loop->yielded_sources.count > 0 &&
+	    event_add_yielded_sources(event_loop, ready_sources) < 0) {
+		return -1;
+	}
+
+	// expired deadlines are handled before all ready event sources, like
+	// the high priority event sources of the timers
+	if (event_loop->deadlines.nodes.count > 0) {
+		event_handle_deadlines(event_loop);
+
+		if (stats) {
+			timestamp = microtime();
+		}
+	}
+
+	event_prioritize_ready_sources(ready_sources);
+
+	// this loop assumes that the ready event sources are valid. because of
+	// this event_remove_source only marks event sources as removed, the
+	// actual removal is done after this loop by event_cleanup_sources
+	for (i = 0; event_loop->running && i < ready_sources->count; ++i) {
+		ready_source = array_get(ready_sources, i);
+
+		// lookup the stats before the event source is handled, because its
+		// name might become invalid if it gets removed during the handling
+		if (stats) {
+			source_stats = event_get_source_stats(event_loop, ready_source->event_source);
+		}
 
-	if (_running) {
+		if (event_loop->watched) {
+			event_begin_dispatch(event_loop, ready_source->event_source->handle,
+			                     ready_source->event_source->type,
+			                     ready_source->event_source->name);
+		}
+
+		event_handle_source(ready_source->event_source, ready_source->received_events);
+
+		if (event_loop->watched) {
+			event_end_dispatch(event_loop);
+		}
+
+		// always advance the timestamp, otherwise the duration recorded for
+		// the next event source would include the handling of this one
+		if (stats) {
+			if (source_stats != NULL) {
+				timestamp = event_record_duration(&source_stats->histogram, timestamp);
+			} else {
+				timestamp = microtime();
+			}
+		}
+	}
+
+	log_event_debug("Handled all ready event sources");
+
+	if (event_loop->deferred_calls.count > 0) {
+		event_handle_deferred_calls(event_loop);
+	}
+
+	if (stats) {
+		timestamp = microtime();
+	}
+
+	// now cleanup event sources that got marked as disconnected/removed
+	// during the event handling
+	cleanup();
+	event_loop_cleanup_sources(event_loop);
+
+	if (stats) {
+		event_record_duration(&event_loop->cleanup_histogram, timestamp);
+	}
+
+	return 0;
+}
+
+int event_loop_run(EventLoop *event_loop, EventCleanupFunction cleanup) {
+	EventLoop *previous_event_loop;
+	int rc = 0;
+
+	if (event_loop->running) {
 		log_warn("Event loop already running");
 
 		return 0;
 	}
 
-	if (_stop_requested) {
+	if (event_loop->stop_requested) {
 		log_debug("Not starting the event loop, stop was requested");
 
 		return 0;
@@ -533,7 +1921,30 @@ int event_run(EventCleanupFunction cleanup) {
 
 	log_debug("Starting the event loop");
 
-	rc = event_run_platform(&_event_sources, &_running, cleanup);
+	// make the event_*_source functions operate on this event loop while it
+	// is running on this thread
+	previous_event_loop = event_set_current_loop(event_loop);
+
+	event_loop->running = true;
+
+	cleanup();
+	event_loop_cleanup_sources(event_loop);
+
+	while (event_loop->running) {
+		if (event_loop->stats_enabled) {
+			rc = event_loop_iterate(event_loop, cleanup, -1, true);
+		} else {
+			rc = event_loop_iterate(event_loop, cleanup, -1, false);
+		}
+
+		if (rc < 0) {
+			break;
+		}
+	}
+
+	event_loop->running = false;
+
+	event_set_current_loop(previous_event_loop);
 
 	if (rc < 0) {
 		log_error("Event loop aborted");
@@ -544,22 +1955,80 @@ int event_run(EventCleanupFunction cleanup) {
 	return rc;
 }
 
-// might be called from a non-main-thread
-void event_stop(void) {
-	uint8_t byte = 0;
+// run a single iteration of the event loop on the calling thread, waiting at
+// most timeout milliseconds for event sources to become ready. a timeout of -1
+// waits until an event source becomes ready or a deadline expires. returns -1
+// on error, 1 if the event loop got stopped and 0 otherwise
+int event_loop_run_once(EventLoop *event_loop, EventCleanupFunction cleanup, int timeout) {
+	EventLoop *previous_event_loop;
+	int rc;
+
+	if (event_loop->running) {
+		log_warn("Event loop already running");
+
+		return 0;
+	}
+
+	if (event_loop->stop_requested) {
+		return 1;
+	}
+
+	previous_event_loop = event_set_current_loop(event_loop);
+
+	event_loop->running = true;
+
+	// event sources might have been removed since the last iteration, as
+	// event_loop_run does before its first iteration
+	cleanup();
+	event_loop_cleanup_sources(event_loop);
+
+	if (event_loop->stats_enabled) {
+		rc = event_loop_iterate(event_loop, cleanup, timeout, true);
+	} else {
+		rc = event_loop_iterate(event_loop, cleanup, timeout, false);
+	}
+
+	event_loop->running = false;
 
-	_stop_requested = true;
+	event_set_current_loop(previous_event_loop);
 
-	if (!_running) {
+	if (rc < 0) {
+		log_error("Event loop iteration aborted");
+
+		return -1;
+	}
+
+	if (event_flush_platform(event_loop) < 0) {
+		return -1;
+	}
+
+	return event_loop->stop_requested ? 1 : 0;
+}
+
+// the returned handle becomes readable if the event loop has ready event
+// sources. this allows to wait for the event loop as part of another main
+// loop and to call event_loop_run_once with a timeout of 0 afterwards. it is
+// only up-to-date after event_loop_run_once returned, because changes to the
+// event sources are applied lazily. the poll based event loop has no such
+// handle and returns IO_HANDLE_INVALID
+IOHandle event_loop_get_handle(EventLoop *event_loop) {
+	return event_get_handle_platform(event_loop);
+}
+
+// might be called from a non-main-thread
+void event_loop_stop(EventLoop *event_loop) {
+	event_loop->stop_requested = true;
+
+	if (!event_loop->running) {
 		return;
 	}
 
-	_running = false;
+	event_loop->running = false;
 
-	// write to the stop pipe to wake the event loop up to make it recognize
+	// signal the stop notifier to wake the event loop up to make it recognize
 	// the stop request
-	if (pipe_write(&_stop_pipe, &byte, sizeof(byte)) < 0) {
-		log_error("Could not write to stop pipe: %s (%d)",
+	if (notifier_signal(&event_loop->stop_notifier) < 0) {
+		log_error("Could not signal stop notifier: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		return;
@@ -567,3 +2036,134 @@ void event_stop(void) {
 
 	log_debug("Stopping the event loop");
 }
+
+// queue a function to be called by the thread running the event loop. this can
+// be called from any thread. the post notifier is only signaled if the queue
+// was drained since the last signal. sets errno on error
+int event_loop_post(EventLoop *event_loop, EventFunction function, void *opaque) {
+	EventTask *task = malloc(sizeof(EventTask));
+
+	if (task == NULL) {
+		errno = ENOMEM;
+
+		return -1;
+	}
+
+	task->function = function;
+	task->opaque = opaque;
+
+	event_push_task(event_loop, task);
+
+	if (event_exchange_flag(&event_loop->post_pending, 1) != 0) {
+		return 0;
+	}
+
+	// the task is queued anyway, so an error here only delays its execution
+	// until the post notifier gets signaled successfully for another task
+	if (notifier_signal(&event_loop->post_notifier) < 0) {
+		log_error("Could not signal post notifier: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		event_exchange_flag(&event_loop->post_pending, 0);
+	}
+
+	return 0;
+}
+
+// enabling the stats resets all previously recorded stats. must only be called
+// from the thread running the event loop or while it is not running
+void event_loop_enable_stats(EventLoop *event_loop, bool enable) {
+	int i;
+	EventSourceStats *source_stats;
+
+	if (enable && !event_loop->stats_enabled) {
+		memset(&event_loop->wait_histogram, 0, sizeof(event_loop->wait_histogram));
+		memset(&event_loop->cleanup_histogram, 0, sizeof(event_loop->cleanup_histogram));
+
+		// the stats are referenced by event sources, only reset their content
+		for (i = 0; i < event_loop->source_stats.count; ++i) {
+			source_stats = array_get(&event_loop->source_stats, i);
+
+			memset(&source_stats->histogram, 0, sizeof(source_stats->histogram));
+		}
+	}
+
+	event_loop->stats_enabled = enable;
+}
+
+static void event_dump_histogram(const char *prefix, EventHistogram *histogram) {
+	char buffer[512];
+	int length;
+	int i;
+
+	if (histogram->count == 0) {
+		return;
+	}
+
+	length = snprintf(buffer, sizeof(buffer), "%s: count %u, total %" PRIu64 "us, average %" PRIu64 "us, max %" PRIu64 "us, buckets",
+	                  prefix, histogram->count, histogram->total,
+	                  histogram->total / histogram->count, histogram->max);
+
+	for (i = 0; i < EVENT_HISTOGRAM_BUCKET_COUNT && length > 0 && length < (int)sizeof(buffer); ++i) {
+		if (histogram->buckets[i] == 0) {
+			continue;
+		}
+
+		if (i < EVENT_HISTOGRAM_BUCKET_COUNT - 1) {
+			length += snprintf(buffer + length, sizeof(buffer) - length, " <%" PRIu64 "us: %u",
+			                   (uint64_t)1 << i, histogram->buckets[i]);
+		} else {
+			length += snprintf(buffer + length, sizeof(buffer) - length, " >=%" PRIu64 "us: %u",
+			                   (uint64_t)1 << (i - 1), histogram->buckets[i]);
+		}
+	}
+
+	log_info("%s", buffer);
+}
+
+// log all recorded stats, e.g. triggered by a SIGUSR1 handler
+void event_loop_dump_stats(EventLoop *event_loop) {
+	int i;
+	EventSourceStats *source_stats;
+	char prefix[128];
+
+	if (!event_loop->stats_enabled) {
+		log_info("Event loop stats are disabled");
+
+		return;
+	}
+
+	event_dump_histogram("Event loop wait", &event_loop->wait_histogram);
+
+	for (i = 0; i < event_loop->source_stats.count; ++i) {
+		source_stats = array_get(&event_loop->source_stats, i);
+
+		snprintf(prefix, sizeof(prefix), "%s event source (name: %s)",
+		         event_get_source_type_name(source_stats->type, true), source_stats->name);
+
+		event_dump_histogram(prefix, &source_stats->histogram);
+	}
+
+	event_dump_histogram("Event loop cleanup", &event_loop->cleanup_histogram);
+}
+
+void event_enable_stats(bool enable) {
+	event_loop_enable_stats(event_get_current_loop(), enable);
+}
+
+void event_dump_stats(void) {
+	event_loop_dump_stats(event_get_current_loop());
+}
+
+int event_run(EventCleanupFunction cleanup) {
+	return event_loop_run(&_default_event_loop, cleanup);
+}
+
+int event_run_once(EventCleanupFunction cleanup, int timeout) { // milliseconds
+	return event_loop_run_once(&_default_event_loop, cleanup, timeout);
+}
+
+// might be called from a non-main-thread
+void event_stop(void) {
+	event_loop_stop(&_default_event_loop);
+}
@@ -33,28 +33,43 @@
 	#endif
 #endif
 
+#include "array.h"
+#include "heap.h"
 #include "io.h"
+#include "notifier.h"
 
 typedef void (*EventFunction)(void *opaque);
+typedef void (*EventHandlerFunction)(void *opaque, uint32_t received_events);
 typedef void (*EventCleanupFunction)(void);
 
+// EVENT_EDGE is not an event but a flag that can be combined with the events
+// of an event source. it requests edge-triggered notification: the event source
+// is only reported as ready again after new data arrived or new buffer space
+// became available. therefore, the functions of such an event source have to
+// read or write until EAGAIN/EWOULDBLOCK. only the epoll based event loop
+// supports this, all other event loops ignore EVENT_EDGE and stay
+// level-triggered. for this reason the functions of such an event source also
+// have to cope with being called again without new data or buffer space
 typedef enum { // bitmask
 #ifdef _WIN32
 	EVENT_READ  = 0x0001,
 	EVENT_WRITE = 0x0004,
 	EVENT_PRIO  = 0x0002,
-	EVENT_ERROR = 0x0008
+	EVENT_ERROR = 0x0008,
+	EVENT_EDGE  = 0x40000000
 #else
 	#if defined __linux__ && defined DAEMONLIB_WITH_EPOLL
 		EVENT_READ  = EPOLLIN,
 		EVENT_WRITE = EPOLLOUT,
 		EVENT_PRIO  = EPOLLPRI,
-		EVENT_ERROR = EPOLLERR
+		EVENT_ERROR = EPOLLERR,
+		EVENT_EDGE  = EPOLLET
 	#else
 		EVENT_READ  = POLLIN,
 		EVENT_WRITE = POLLOUT,
 		EVENT_PRIO  = POLLPRI,
-		EVENT_ERROR = POLLERR
+		EVENT_ERROR = POLLERR,
+		EVENT_EDGE  = 0x40000000
 	#endif
 #endif
 } Event;
@@ -72,37 +87,247 @@ typedef enum {
 	EVENT_SOURCE_STATE_MODIFIED
 } EventSourceState;
 
+// ready event sources of high priority are handled before all other ready
+// event sources in each iteration of the event loop
+typedef enum {
+	EVENT_SOURCE_PRIORITY_NORMAL = 0,
+	EVENT_SOURCE_PRIORITY_HIGH
+} EventSourcePriority;
+
+#define EVENT_HISTOGRAM_BUCKET_COUNT 32
+
+// log-scale histogram of durations. bucket 0 counts durations below 1
+// microsecond, bucket N counts durations below 2^N microseconds that are not
+// counted in bucket N-1. the last bucket also counts all longer durations
+typedef struct {
+	uint32_t buckets[EVENT_HISTOGRAM_BUCKET_COUNT];
+	uint32_t count;
+	uint64_t total; // in microseconds
+	uint64_t max; // in microseconds
+} EventHistogram;
+
 typedef struct {
+	EventSourceType type;
+	char name[64];
+	EventHistogram histogram;
+} EventSourceStats;
+
+typedef struct _EventSource EventSource;
+
+// the fields that event.c accesses for each ready event source come first.
+// event sources are allocated at multiples of 32 bytes and their size is
+// rounded up to a multiple of 32 bytes, therefore these fields never straddle
+// a cache line. all other fields are mostly accessed if an event source gets
+// added, modified, looked up, removed or logged
+struct _EventSource {
+	EventHandlerFunction handler;
+	void *opaque;
+	EventSourceState state;
+	EventSourcePriority priority;
+	uint32_t events;
+	uint32_t yielded_events; // for internal use by event.c only
 	IOHandle handle;
 	EventSourceType type;
 	const char *name;
-	uint32_t events;
-	EventSourceState state;
-	EventFunction read;
-	void *read_opaque;
-	EventFunction write;
-	void *write_opaque;
-	EventFunction prio;
-	void *prio_opaque;
-	EventFunction error;
-	void *error_opaque;
-} EventSource;
+	void *platform_data; // for internal use by the platform backend only
+	uint32_t platform_events; // for internal use by the platform backend only
+	int platform_slot; // for internal use by the platform backend only
+	EventSource *index_next; // for internal use by event.c only
+	EventSourceStats *stats; // for internal use by event.c only
+	int source_slot; // for internal use by event.c only
+	bool dirty; // for internal use by event.c only
+};
+
+typedef struct {
+	EventSource *event_source;
+	uint32_t received_events;
+} EventReadySource;
+
+// allocates objects from slabs, for internal use by event.c only
+typedef struct {
+	int item_size; // multiple of the alignment
+	int alignment; // power of 2
+	Array slabs; // pointers to blocks of EVENT_POOL_SLAB_SIZE items each
+	void *free_items; // linked through the first bytes of each free item
+} EventPool;
+
+typedef struct _EventLoop EventLoop;
+
+typedef struct _EventTask EventTask;
+
+struct _EventTask {
+	EventTask *next;
+	EventFunction function;
+	void *opaque;
+};
+
+// a lightweight one-shot deadline that is allocated by the caller, e.g.
+// embedded into a client struct. it needs no file descriptor, the event loop
+// keeps it in a heap and limits its wait timeout to the earliest deadline
+typedef struct {
+	HeapNode heap_node; // key is the microtime expiry, for internal use by event.c only
+	EventLoop *event_loop; // NULL if not scheduled, for internal use by event.c only
+	EventFunction function;
+	void *opaque;
+} EventDeadline;
+
+// a deferred call is allocated by the caller, e.g. embedded into a client
+// struct. it allows to batch work per iteration of the event loop instead of
+// doing it per event, e.g. to flush coalesced writes
+typedef struct {
+	int slot; // -1 if not deferred, for internal use by event.c only
+	EventLoop *event_loop; // NULL if not deferred, for internal use by event.c only
+	EventFunction function;
+	void *opaque;
+} EventDeferredCall;
+
+// an event loop and its event sources are bound to the thread that runs it.
+// its event sources must only be added, modified or removed from that thread,
+// or while the event loop is not running. only event_loop_stop and
+// event_loop_post can be called from any thread. an event loop must not be
+// moved in memory after it was created
+struct _EventLoop {
+	Array sources; // EventSource pointers
+	EventPool source_pool; // EventSource objects
+	EventPool legacy_pool; // for the event functions of the event_*_source functions
+	Array dirty_sources; // EventSource pointers, not in normal state
+	bool dirty_sources_overflowed; // true if a dirty event source could not be recorded
+	EventSource **source_index; // hash table of (handle, type) tuples
+	uint32_t source_index_size; // number of buckets, power of 2
+	bool running;
+	bool stop_requested;
+	Array ready_sources; // EventReadySource objects, filled by the platform backend
+	Array yielded_sources; // EventSource pointers, handled again in the next iteration
+	Heap deadlines; // EventDeadline heap nodes, ordered by expiry
+	Array deferred_calls; // EventDeferredCall pointers, NULL if cancelled
+	bool stats_enabled;
+	bool watched; // true while an event watchdog observes this event loop
+	IOHandle dispatch_handle; // IO_HANDLE_INVALID while handling deadlines or deferred calls, read by the event watchdog
+	EventSourceType dispatch_type; // read by the event watchdog
+	char dispatch_name[64]; // copy of the event source name, read by the event watchdog
+	uint64_t dispatch_start; // microtime, 0 while not dispatching, read by the event watchdog
+	EventHistogram wait_histogram;
+	EventHistogram cleanup_histogram;
+	Array source_stats; // EventSourceStats objects
+	Notifier stop_notifier;
+	Notifier post_notifier;
+	EventTask post_stub; // MPSC queue of posted tasks
+	EventTask *post_head; // only accessed by the thread running the event loop
+	EventTask *post_tail; // exchanged by all posting threads
+	int post_pending; // 1 if the post notifier got signaled since the last drain
+	void *platform; // for internal use by the platform backend only
+	bool platform_fallback; // for internal use by the platform backend only
+};
 
 const char *event_get_source_type_name(EventSourceType type, bool upper);
 
 int event_init(void);
 void event_exit(void);
 
+EventLoop *event_get_default_loop(void);
+EventLoop *event_get_current_loop(void);
+EventLoop *event_set_current_loop(EventLoop *event_loop);
+
+int event_loop_create(EventLoop *event_loop);
+void event_loop_destroy(EventLoop *event_loop);
+
+// the handler is called once per wakeup with all events that were received
+// for the event source. event sources added with a handler cannot be modified
+// by the event_*_modify_source functions
+int event_loop_add_handler(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                           const char *name, uint32_t events, EventHandlerFunction handler,
+                           void *opaque);
+int event_loop_modify_handler(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                              uint32_t events_to_remove, uint32_t events_to_add);
+
+int event_loop_add_source(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                          const char *name, uint32_t events, EventFunction function,
+                          void *opaque);
+int event_loop_modify_source(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                             uint32_t events_to_remove, uint32_t events_to_add,
+                             EventFunction function, void *opaque);
+void event_loop_remove_source(EventLoop *event_loop, IOHandle handle, EventSourceType type);
+
+// the priority of an event source is reset to normal if it gets readded
+void event_loop_set_source_priority(EventLoop *event_loop, IOHandle handle,
+                                    EventSourceType type, EventSourcePriority priority);
+
+// a handler that stopped processing an event source with work remaining can
+// yield it. the event source is then handled again in the next iteration of
+// the event loop for the given events, even if it does not become ready again.
+// the event loop does not block while an event source is yielded
+int event_loop_yield_source(EventLoop *event_loop, IOHandle handle, EventSourceType type,
+                            uint32_t events);
+void event_loop_cleanup_sources(EventLoop *event_loop);
+
+// the function of a deadline is called once after the delay elapsed. because
+// the wait timeout has millisecond resolution the call might happen up to a
+// millisecond later than necessary. scheduling an already scheduled deadline
+// moves it to the new delay. a deadline can only be scheduled in one event loop
+// at a time, scheduling or cancelling it in another event loop fails
+void event_init_deadline(EventDeadline *deadline, EventFunction function, void *opaque);
+int event_loop_schedule_deadline(EventLoop *event_loop, EventDeadline *deadline,
+                                 uint64_t delay); // microseconds
+void event_loop_cancel_deadline(EventLoop *event_loop, EventDeadline *deadline);
+
+// the function of a deferred call is called once after all ready event
+// sources of the current iteration were handled, but before the event sources
+// are cleaned up. deferring an already deferred call does nothing. calls that
+// get deferred by the function of a deferred call are called in the next
+// iteration, the event loop does not block before that. like a deadline, a
+// call can only be deferred in one event loop at a time
+void event_init_deferred_call(EventDeferredCall *call, EventFunction function, void *opaque);
+int event_loop_defer_call(EventLoop *event_loop, EventDeferredCall *call);
+void event_loop_cancel_deferred_call(EventLoop *event_loop, EventDeferredCall *call);
+
+int event_loop_run(EventLoop *event_loop, EventCleanupFunction cleanup);
+void event_loop_stop(EventLoop *event_loop);
+
+// these functions allow to embed an event loop into a foreign main loop. the
+// foreign main loop waits for the handle of the event loop, limited by the
+// timeout of the event loop, and then runs a single iteration of it
+int event_loop_run_once(EventLoop *event_loop, EventCleanupFunction cleanup,
+                        int timeout); // milliseconds
+IOHandle event_loop_get_handle(EventLoop *event_loop);
+int event_loop_get_timeout(EventLoop *event_loop); // milliseconds
+
+int event_loop_post(EventLoop *event_loop, EventFunction function, void *opaque);
+
+void event_loop_enable_stats(EventLoop *event_loop, bool enable);
+void event_loop_dump_stats(EventLoop *event_loop);
+
+// these functions operate on the event loop that is running on the calling
+// thread, or on the default event loop if no event loop is running on it
+int event_add_handler(IOHandle handle, EventSourceType type, const char *name,
+                      uint32_t events, EventHandlerFunction handler, void *opaque);
+int event_modify_handler(IOHandle handle, EventSourceType type, uint32_t events_to_remove,
+                         uint32_t events_to_add);
+
 int event_add_source(IOHandle handle, EventSourceType type, const char *name,
                      uint32_t events, EventFunction function, void *opaque);
 int event_modify_source(IOHandle handle, EventSourceType type, uint32_t events_to_remove,
                         uint32_t events_to_add, EventFunction function, void *opaque);
 void event_remove_source(IOHandle handle, EventSourceType type);
+void event_set_source_priority(IOHandle handle, EventSourceType type,
+                               EventSourcePriority priority);
+int event_yield_source(IOHandle handle, EventSourceType type, uint32_t events);
 void event_cleanup_sources(void);
 
+int event_schedule_deadline(EventDeadline *deadline, uint64_t delay); // microseconds
+void event_cancel_deadline(EventDeadline *deadline);
+int event_defer_call(EventDeferredCall *call);
+void event_cancel_deferred_call(EventDeferredCall *call);
+
+int event_post(EventFunction function, void *opaque);
+
+void event_enable_stats(bool enable);
+void event_dump_stats(void);
+
 void event_handle_source(EventSource *event_source, uint32_t received_events);
 
+// these functions operate on the default event loop
 int event_run(EventCleanupFunction cleanup);
+int event_run_once(EventCleanupFunction cleanup, int timeout); // milliseconds
 void event_stop(void);
 
 #endif // DAEMONLIB_EVENT_H
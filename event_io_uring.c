@@ -0,0 +1,831 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_io_uring.c: io_uring based event loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * this event loop uses io_uring poll requests instead of an epollfd. poll
+ * requests for all event sources are queued in the submission ring and are
+ * submitted together with a single io_uring_enter call that also waits for
+ * completions. a poll request is one-shot, it is rearmed after its event
+ * source was handled. this results in the same level-triggered semantic as
+ * the epoll based event loop.
+ *
+ * this file is used instead of event_linux.c if DAEMONLIB_WITH_IO_URING is
+ * defined in addition to DAEMONLIB_WITH_EPOLL. if the running kernel does not
+ * provide io_uring (or lacks required features) then the epoll based event
+ * loop from event_linux.c is used as fallback.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined __NR_io_uring_setup && defined __NR_io_uring_enter
+	#include <linux/io_uring.h>
+#endif
+
+#include "event.h"
+
+#include "array.h"
+#include "log.h"
+#include "threads.h"
+#include "utils.h"
+
+// include the epoll based event loop as fallback with renamed functions
+#define _log_source _log_source_epoll
+#define event_init_platform event_init_platform_epoll
+#define event_exit_platform event_exit_platform_epoll
+#define event_source_added_platform event_source_added_platform_epoll
+#define event_source_modified_platform event_source_modified_platform_epoll
+#define event_source_removed_platform event_source_removed_platform_epoll
+#define event_wait_platform event_wait_platform_epoll
+#define event_get_handle_platform event_get_handle_platform_epoll
+#define event_flush_platform event_flush_platform_epoll
+
+#include "event_linux.c"
+
+#undef _log_source
+#undef event_init_platform
+#undef event_exit_platform
+#undef event_source_added_platform
+#undef event_source_modified_platform
+#undef event_source_removed_platform
+#undef event_wait_platform
+#undef event_get_handle_platform
+#undef event_flush_platform
+
+static LogSource _log_source = LOG_SOURCE_INITIALIZER;
+
+#if defined __NR_io_uring_setup && defined __NR_io_uring_enter && \
+    defined IORING_FEAT_NODROP && defined IORING_SETUP_CQSIZE
+
+#define SUBMISSION_RING_SIZE 256
+#define COMPLETION_RING_SIZE 4096
+
+// user_data for requests whose completion is not of interest
+#define IGNORED_USER_DATA 0
+
+typedef struct {
+	EventSource *event_source; // NULL if the event source got removed
+	uint32_t armed_events; // events the in-flight poll request is armed for
+	bool armed; // true if a poll request is in-flight
+	bool cancelling; // true if a poll remove request is in-flight
+	int slot; // index in dirty_polls or orphaned_polls array, -1 if in neither
+} EventPoll;
+
+typedef struct {
+	int ring_fd;
+	void *ring_memory; // submission and completion ring
+	size_t ring_memory_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+	uint32_t unsubmitted_count;
+	int poll_count; // number of existing EventPoll objects
+	Array dirty_polls; // EventPoll pointers that need to be (re)armed
+	Array orphaned_polls; // EventPoll pointers of removed event sources
+	struct __kernel_timespec timeout; // read by the kernel on submission
+} EventIOUring;
+
+static Mutex _decision_mutex = { PTHREAD_MUTEX_INITIALIZER };
+static bool _use_epoll_decided = false; // protected by the decision mutex
+static bool _use_epoll = false; // protected by the decision mutex
+
+static int io_uring_setup_(unsigned int entries, struct io_uring_params *params) {
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter_(int fd, unsigned int to_submit,
+                           unsigned int min_complete, unsigned int flags) {
+	return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+	                    flags, NULL, 0);
+}
+
+static int event_create_ring(EventIOUring *platform) {
+	struct io_uring_params params;
+	uint8_t *sq_ring;
+
+	memset(&params, 0, sizeof(params));
+
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = COMPLETION_RING_SIZE;
+
+	platform->ring_fd = io_uring_setup_(SUBMISSION_RING_SIZE, &params);
+
+	if (platform->ring_fd < 0) {
+		return -1;
+	}
+
+	// without IORING_FEAT_NODROP completions could get lost if the completion
+	// ring overflows. then the affected event sources would never be rearmed.
+	// IORING_FEAT_SINGLE_MMAP is just a simplification, it was introduced
+	// before IORING_FEAT_NODROP
+	if ((params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+		robust_close(platform->ring_fd);
+
+		errno = ENOTSUP;
+
+		return -1;
+	}
+
+	platform->ring_memory_size = MAX(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+	                        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+	platform->ring_memory = mmap(NULL, platform->ring_memory_size, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, platform->ring_fd, IORING_OFF_SQ_RING);
+
+	if (platform->ring_memory == MAP_FAILED) {
+		robust_close(platform->ring_fd);
+
+		return -1;
+	}
+
+	platform->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	platform->sqes = mmap(NULL, platform->sqes_size, PROT_READ | PROT_WRITE,
+	             MAP_SHARED | MAP_POPULATE, platform->ring_fd, IORING_OFF_SQES);
+
+	if (platform->sqes == MAP_FAILED) {
+		munmap(platform->ring_memory, platform->ring_memory_size);
+		robust_close(platform->ring_fd);
+
+		return -1;
+	}
+
+	sq_ring = platform->ring_memory;
+
+	platform->sq_head = (uint32_t *)(sq_ring + params.sq_off.head);
+	platform->sq_tail = (uint32_t *)(sq_ring + params.sq_off.tail);
+	platform->sq_mask = *(uint32_t *)(sq_ring + params.sq_off.ring_mask);
+	platform->sq_entries = *(uint32_t *)(sq_ring + params.sq_off.ring_entries);
+	platform->sq_array = (uint32_t *)(sq_ring + params.sq_off.array);
+	platform->cq_head = (uint32_t *)(sq_ring + params.cq_off.head);
+	platform->cq_tail = (uint32_t *)(sq_ring + params.cq_off.tail);
+	platform->cq_mask = *(uint32_t *)(sq_ring + params.cq_off.ring_mask);
+	platform->cqes = (struct io_uring_cqe *)(sq_ring + params.cq_off.cqes);
+
+	platform->unsubmitted_count = 0;
+
+	return 0;
+}
+
+static void event_destroy_ring(EventIOUring *platform) {
+	munmap(platform->sqes, platform->sqes_size);
+	munmap(platform->ring_memory, platform->ring_memory_size);
+	robust_close(platform->ring_fd);
+}
+
+// submit all queued requests without waiting for completions
+static int event_submit_requests(EventIOUring *platform) {
+	int rc;
+
+	while (platform->unsubmitted_count > 0) {
+		rc = io_uring_enter_(platform->ring_fd, platform->unsubmitted_count, 0, 0);
+
+		if (rc < 0) {
+			if (errno_interrupted()) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		platform->unsubmitted_count -= rc;
+	}
+
+	return 0;
+}
+
+// returns NULL on error (sets errno) or a zeroed submission queue entry
+static struct io_uring_sqe *event_get_sqe(EventIOUring *platform) {
+	uint32_t tail = *platform->sq_tail;
+	uint32_t index;
+	struct io_uring_sqe *sqe;
+
+	if (tail - __atomic_load_n(platform->sq_head, __ATOMIC_ACQUIRE) >= platform->sq_entries) {
+		// submission ring is full, submit queued requests to make room
+		if (event_submit_requests(platform) < 0) {
+			return NULL;
+		}
+	}
+
+	index = tail & platform->sq_mask;
+	sqe = &platform->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+
+	platform->sq_array[index] = index;
+
+	return sqe;
+}
+
+static void event_queue_sqe(EventIOUring *platform) {
+	__atomic_store_n(platform->sq_tail, *platform->sq_tail + 1, __ATOMIC_RELEASE);
+
+	++platform->unsubmitted_count;
+}
+
+static int event_arm_poll(EventIOUring *platform, EventPoll *poll) {
+	struct io_uring_sqe *sqe = event_get_sqe(platform);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = poll->event_source->handle;
+	sqe->poll_events = (uint16_t)(poll->event_source->events & ~EVENT_EDGE); // one-shot poll requests are level-triggered only
+	sqe->user_data = (uint64_t)(uintptr_t)poll;
+
+	event_queue_sqe(platform);
+
+	poll->armed_events = poll->event_source->events;
+	poll->armed = true;
+
+	return 0;
+}
+
+// the timeout request completes after the given time or as soon as any other
+// request completes, whatever happens first
+static int event_queue_timeout(EventIOUring *platform, int timeout) {
+	struct io_uring_sqe *sqe = event_get_sqe(platform);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	platform->timeout.tv_sec = timeout / 1000;
+	platform->timeout.tv_nsec = (timeout % 1000) * 1000000;
+
+	sqe->opcode = IORING_OP_TIMEOUT;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)&platform->timeout;
+	sqe->len = 1;
+	sqe->off = 1;
+	sqe->user_data = IGNORED_USER_DATA;
+
+	event_queue_sqe(platform);
+
+	return 0;
+}
+
+static int event_cancel_poll(EventIOUring *platform, EventPoll *poll) {
+	struct io_uring_sqe *sqe = event_get_sqe(platform);
+
+	if (sqe == NULL) {
+		return -1;
+	}
+
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)poll;
+	sqe->user_data = IGNORED_USER_DATA;
+
+	event_queue_sqe(platform);
+
+	poll->cancelling = true;
+
+	return 0;
+}
+
+// append a poll to the dirty or orphaned poll array. a poll can only be in one
+// of these arrays at a time, its slot is the index in that array
+static int event_append_poll(Array *polls, EventPoll *poll) {
+	EventPoll **appended_poll = array_append(polls);
+
+	if (appended_poll == NULL) {
+		return -1;
+	}
+
+	*appended_poll = poll;
+	poll->slot = polls->count - 1;
+
+	return 0;
+}
+
+static void event_remove_poll(Array *polls, EventPoll *poll) {
+	EventPoll *last_poll = *(EventPoll **)array_get(polls, polls->count - 1);
+
+	*(EventPoll **)array_get(polls, poll->slot) = last_poll;
+	last_poll->slot = poll->slot;
+	poll->slot = -1;
+
+	array_remove(polls, polls->count - 1, NULL);
+}
+
+static int event_mark_poll_dirty(EventIOUring *platform, EventPoll *poll) {
+	if (poll->slot >= 0) {
+		return 0;
+	}
+
+	if (event_append_poll(&platform->dirty_polls, poll) < 0) {
+		log_error("Could not append to dirty poll array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static void event_destroy_poll(EventIOUring *platform, EventPoll *poll) {
+	free(poll);
+
+	--platform->poll_count;
+}
+
+// destroy polls that are still referenced by in-flight requests. must only be
+// called after the ring was destroyed
+static void event_destroy_orphaned_polls(EventIOUring *platform) {
+	int i;
+
+	for (i = 0; i < platform->orphaned_polls.count; ++i) {
+		event_destroy_poll(platform, *(EventPoll **)array_get(&platform->orphaned_polls, i));
+	}
+
+	array_destroy(&platform->orphaned_polls, NULL);
+}
+
+// (re)arm all dirty polls for their current events. if a poll request is
+// already in-flight for outdated events then it is cancelled first and gets
+// rearmed once its completion arrives. polls that could not be (re)armed or
+// cancelled stay dirty and are retried on the next call
+static void event_update_polls(EventIOUring *platform) {
+	int i;
+	int count = 0;
+	EventPoll *poll;
+	EventSource *event_source;
+
+	for (i = 0; i < platform->dirty_polls.count; ++i) {
+		poll = *(EventPoll **)array_get(&platform->dirty_polls, i);
+		poll->slot = -1;
+		event_source = poll->event_source;
+
+		if (poll->armed) {
+			if (poll->armed_events != event_source->events && !poll->cancelling) {
+				if (event_cancel_poll(platform, poll) < 0) {
+					log_error("Could not cancel poll request for %s event source (handle: %d): %s (%d)",
+					          event_get_source_type_name(event_source->type, false),
+					          event_source->handle, get_errno_name(errno), errno);
+
+					poll->slot = count;
+				}
+			}
+		} else if (event_source->events != 0) {
+			if (event_arm_poll(platform, poll) < 0) {
+				log_error("Could not arm poll request for %s event source (handle: %d): %s (%d)",
+				          event_get_source_type_name(event_source->type, false),
+				          event_source->handle, get_errno_name(errno), errno);
+
+				poll->slot = count;
+			}
+		}
+
+		// compact the still dirty polls at the front of the array
+		if (poll->slot >= 0) {
+			*(EventPoll **)array_get(&platform->dirty_polls, count++) = poll;
+		}
+	}
+
+	array_resize(&platform->dirty_polls, count, NULL);
+}
+
+// collects the ready event sources of completed poll requests. polls of event sources that
+// got removed in the meantime are destroyed here. this is the only place where
+// they can be destroyed safely, because until now the kernel might still have
+// referred to them
+static int event_collect_completions(EventIOUring *platform, Array *ready_sources) {
+	uint32_t head = *platform->cq_head;
+	uint32_t tail = __atomic_load_n(platform->cq_tail, __ATOMIC_ACQUIRE);
+	struct io_uring_cqe *cqe;
+	EventPoll *poll;
+	uint32_t received_events;
+	EventReadySource *ready_source;
+
+	for (; head != tail; ++head) {
+		cqe = &platform->cqes[head & platform->cq_mask];
+
+		if (cqe->user_data == IGNORED_USER_DATA) {
+			continue;
+		}
+
+		poll = (EventPoll *)(uintptr_t)cqe->user_data;
+		poll->armed = false;
+		poll->cancelling = false;
+
+		if (poll->event_source == NULL) {
+			if (poll->slot >= 0) {
+				event_remove_poll(&platform->orphaned_polls, poll);
+			}
+
+			event_destroy_poll(platform, poll);
+
+			continue;
+		}
+
+		if (cqe->res == -ECANCELED) {
+			received_events = 0;
+		} else if (cqe->res < 0) {
+			log_error("Could not poll on %s event source (handle: %d): %s (%d)",
+			          event_get_source_type_name(poll->event_source->type, false),
+			          poll->event_source->handle, get_errno_name(-cqe->res), -cqe->res);
+
+			// report the failure to the event source like an error condition
+			// reported by poll. it gets rearmed as well, so the event source
+			// doesn't go silent if the failure was only temporary
+			received_events = EVENT_ERROR;
+		} else {
+			received_events = (uint32_t)cqe->res;
+		}
+
+		if (received_events != 0) {
+			ready_source = array_append(ready_sources);
+
+			if (ready_source == NULL) {
+				__atomic_store_n(platform->cq_head, head, __ATOMIC_RELEASE);
+
+				log_error("Could not append to ready event source array: %s (%d)",
+				          get_errno_name(errno), errno);
+
+				return -1;
+			}
+
+			ready_source->event_source = poll->event_source;
+			ready_source->received_events = received_events;
+		}
+
+		// the poll request is one-shot, rearm it after the event source was
+		// handled or immediately if it was cancelled due to a modification
+		event_mark_poll_dirty(platform, poll);
+	}
+
+	__atomic_store_n(platform->cq_head, head, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+// decides once if io_uring or epoll is used by creating a probe ring. event
+// loops can be created on different threads, each event loop remembers the
+// decision in its platform_fallback field
+static bool event_use_epoll(void) {
+	EventIOUring probe;
+	bool use_epoll;
+
+	mutex_lock(&_decision_mutex);
+
+	if (!_use_epoll_decided) {
+		if (event_create_ring(&probe) < 0) {
+			log_info("Could not create io_uring, using epoll instead: %s (%d)",
+			         get_errno_name(errno), errno);
+
+			_use_epoll = true;
+		} else {
+			event_destroy_ring(&probe);
+		}
+
+		_use_epoll_decided = true;
+	}
+
+	use_epoll = _use_epoll;
+
+	mutex_unlock(&_decision_mutex);
+
+	return use_epoll;
+}
+
+int event_init_platform(EventLoop *event_loop) {
+	int phase = 0;
+	EventIOUring *platform;
+
+	if (event_use_epoll()) {
+		event_loop->platform_fallback = true;
+
+		return event_init_platform_epoll(event_loop);
+	}
+
+	// allocate platform data
+	platform = calloc(1, sizeof(EventIOUring));
+
+	if (platform == NULL) {
+		errno = ENOMEM;
+
+		log_error("Could not allocate io_uring event loop: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	// create ring
+	if (event_create_ring(platform) < 0) {
+		log_error("Could not create io_uring: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	// create dirty poll array
+	if (array_create(&platform->dirty_polls, 32, sizeof(EventPoll *), true) < 0) {
+		log_error("Could not create dirty poll array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 3;
+
+	// create orphaned poll array
+	if (array_create(&platform->orphaned_polls, 32, sizeof(EventPoll *), true) < 0) {
+		log_error("Could not create orphaned poll array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	event_loop->platform = platform;
+
+	phase = 4;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 3:
+		array_destroy(&platform->dirty_polls, NULL);
+		// fall through
+
+	case 2:
+		event_destroy_ring(platform);
+		// fall through
+
+	case 1:
+		free(platform);
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 4 ? 0 : -1;
+}
+
+void event_exit_platform(EventLoop *event_loop) {
+	EventIOUring *platform = event_loop->platform;
+
+	if (event_loop->platform_fallback) {
+		event_exit_platform_epoll(event_loop);
+
+		return;
+	}
+
+	// destroying the ring cancels all in-flight requests, afterwards the
+	// polls of removed event sources can be destroyed safely
+	event_destroy_ring(platform);
+	event_destroy_orphaned_polls(platform);
+
+	array_destroy(&platform->dirty_polls, NULL);
+
+	free(platform);
+}
+
+int event_source_added_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventIOUring *platform = event_loop->platform;
+	EventPoll *poll;
+
+	if (event_loop->platform_fallback) {
+		return event_source_added_platform_epoll(event_loop, event_source);
+	}
+
+	poll = calloc(1, sizeof(EventPoll));
+
+	if (poll == NULL) {
+		log_error("Could not allocate poll for %s event source (handle: %d): %s (%d)",
+		          event_get_source_type_name(event_source->type, false),
+		          event_source->handle, get_errno_name(ENOMEM), ENOMEM);
+
+		return -1;
+	}
+
+	poll->event_source = event_source;
+	poll->slot = -1;
+
+	++platform->poll_count;
+
+	if (event_mark_poll_dirty(platform, poll) < 0) {
+		event_destroy_poll(platform, poll);
+
+		return -1;
+	}
+
+	event_source->platform_data = poll;
+
+	return 0;
+}
+
+// modifications are only recorded here and applied by event_update_polls right
+// before the next io_uring_enter call
+int event_source_modified_platform(EventLoop *event_loop, EventSource *event_source) {
+	if (event_loop->platform_fallback) {
+		return event_source_modified_platform_epoll(event_loop, event_source);
+	}
+
+	return event_mark_poll_dirty(event_loop->platform, event_source->platform_data);
+}
+
+void event_source_removed_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventIOUring *platform = event_loop->platform;
+	EventPoll *poll;
+
+	if (event_loop->platform_fallback) {
+		event_source_removed_platform_epoll(event_loop, event_source);
+
+		return;
+	}
+
+	poll = event_source->platform_data;
+	event_source->platform_data = NULL;
+
+	if (poll->slot >= 0) {
+		event_remove_poll(&platform->dirty_polls, poll);
+	}
+
+	poll->event_source = NULL;
+
+	if (!poll->armed) {
+		event_destroy_poll(platform, poll);
+
+		return;
+	}
+
+	// the poll will be destroyed once the completion of its poll request
+	// arrives. the handle might be closed right after this call, but the poll
+	// request holds its own reference to the underlying file
+	if (event_append_poll(&platform->orphaned_polls, poll) < 0) {
+		log_error("Could not append to orphaned poll array: %s (%d)",
+		          get_errno_name(errno), errno);
+	}
+
+	if (!poll->cancelling && event_cancel_poll(platform, poll) < 0) {
+		log_error("Could not cancel poll request for %s event source (handle: %d): %s (%d)",
+		          event_get_source_type_name(event_source->type, false),
+		          event_source->handle, get_errno_name(errno), errno);
+	}
+}
+
+// the ring fd becomes readable if the completion ring is not empty
+IOHandle event_get_handle_platform(EventLoop *event_loop) {
+	EventIOUring *platform = event_loop->platform;
+
+	if (event_loop->platform_fallback) {
+		return event_get_handle_platform_epoll(event_loop);
+	}
+
+	return platform->ring_fd;
+}
+
+// submit the poll requests of all event sources, otherwise their completions
+// cannot make the ring fd readable while someone else waits on it
+int event_flush_platform(EventLoop *event_loop) {
+	EventIOUring *platform = event_loop->platform;
+
+	if (event_loop->platform_fallback) {
+		return event_flush_platform_epoll(event_loop);
+	}
+
+	event_update_polls(platform);
+
+	if (event_submit_requests(platform) < 0) {
+		log_error("Could not submit requests: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int event_wait_platform(EventLoop *event_loop, int timeout, Array *ready_sources) {
+	EventIOUring *platform = event_loop->platform;
+	uint32_t min_complete = 1;
+	uint32_t flags = IORING_ENTER_GETEVENTS;
+	int rc;
+
+	if (event_loop->platform_fallback) {
+		return event_wait_platform_epoll(event_loop, timeout, ready_sources);
+	}
+
+	event_update_polls(platform);
+
+	if (timeout == 0) {
+		min_complete = 0;
+		flags = 0;
+	} else if (timeout > 0 && event_queue_timeout(platform, timeout) < 0) {
+		log_error("Could not queue timeout request: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	// submit queued requests and wait for completions
+	log_event_debug("Starting to wait on %d event source(s)", platform->poll_count);
+
+	rc = io_uring_enter_(platform->ring_fd, platform->unsubmitted_count, min_complete, flags);
+
+	if (rc < 0) {
+		if (errno_interrupted()) {
+			log_debug("Waiting for completions got interrupted");
+
+			return 0;
+		}
+
+		// EBUSY means the kernel cannot accept new requests until some
+		// completions got collected, proceed to do that
+		if (errno != EBUSY && errno != EAGAIN) {
+			log_error("Count not wait for completions: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+	} else {
+		platform->unsubmitted_count -= rc;
+	}
+
+	// the event sources stored in the polls stay valid until the ready event
+	// sources are handled, because event_remove_source only marks event
+	// sources as removed, the actual removal is done afterwards by
+	// event_cleanup_sources
+	if (event_collect_completions(platform, ready_sources) < 0) {
+		return -1;
+	}
+
+	log_event_debug("Poll requests returned %d event source(s) as ready", ready_sources->count);
+
+	return 0;
+}
+
+#else
+
+// the io_uring interface is not available at build time, always use epoll
+int event_init_platform(EventLoop *event_loop) {
+	log_info("Built without io_uring support, using epoll instead");
+
+	return event_init_platform_epoll(event_loop);
+}
+
+void event_exit_platform(EventLoop *event_loop) {
+	event_exit_platform_epoll(event_loop);
+}
+
+int event_source_added_platform(EventLoop *event_loop, EventSource *event_source) {
+	return event_source_added_platform_epoll(event_loop, event_source);
+}
+
+int event_source_modified_platform(EventLoop *event_loop, EventSource *event_source) {
+	return event_source_modified_platform_epoll(event_loop, event_source);
+}
+
+void event_source_removed_platform(EventLoop *event_loop, EventSource *event_source) {
+	event_source_removed_platform_epoll(event_loop, event_source);
+}
+
+int event_wait_platform(EventLoop *event_loop, int timeout, Array *ready_sources) {
+	return event_wait_platform_epoll(event_loop, timeout, ready_sources);
+}
+
+IOHandle event_get_handle_platform(EventLoop *event_loop) {
+	return event_get_handle_platform_epoll(event_loop);
+}
+
+int event_flush_platform(EventLoop *event_loop) {
+	return event_flush_platform_epoll(event_loop);
+}
+
+#endif
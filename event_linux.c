@@ -22,6 +22,7 @@
 #include <errno.h>
 #include <stdbool.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <unistd.h>
@@ -34,30 +35,110 @@
 
 static LogSource _log_source = LOG_SOURCE_INITIALIZER;
 
-static int _epollfd;
-static int _epollfd_event_count;
+// platform slot of an event source that got removed from the epollfd after
+// its modification failed. it stays detached until it is removed
+#define DETACHED_PLATFORM_SLOT -2
+
+typedef struct {
+	int epollfd;
+	int epollfd_event_count;
+	Array pending_modifications; // EventSource pointers
+	Array received_events; // epoll_event objects
+	uint32_t applied_modification_count; // number of EPOLL_CTL_MOD calls
+	uint32_t saved_modification_count; // number of avoided EPOLL_CTL_MOD calls
+} EventLinux;
+
+int event_init_platform(EventLoop *event_loop) {
+	int phase = 0;
+	EventLinux *platform;
+
+	// allocate platform data
+	platform = calloc(1, sizeof(EventLinux));
+
+	if (platform == NULL) {
+		errno = ENOMEM;
+
+		log_error("Could not allocate epoll event loop: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	// create pending modification array
+	if (array_create(&platform->pending_modifications, 32, sizeof(EventSource *), true) < 0) {
+		log_error("Could not create pending modification array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	// create epoll event array
+	if (array_create(&platform->received_events, 32, sizeof(struct epoll_event), true) < 0) {
+		log_error("Could not create epoll event array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 3;
 
-int event_init_platform(void) {
 	// create epollfd
-	_epollfd = epoll_create1(EPOLL_CLOEXEC);
+	platform->epollfd = epoll_create1(EPOLL_CLOEXEC);
 
-	if (_epollfd < 0) {
+	if (platform->epollfd < 0) {
 		log_error("Could not create epollfd: %s (%d)",
 		          get_errno_name(errno), errno);
 
-		return -1;
+		goto cleanup;
 	}
 
-	_epollfd_event_count = 0;
+	event_loop->platform = platform;
 
-	return 0;
+	phase = 4;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 3:
+		array_destroy(&platform->received_events, NULL);
+		// fall through
+
+	case 2:
+		array_destroy(&platform->pending_modifications, NULL);
+		// fall through
+
+	case 1:
+		free(platform);
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 4 ? 0 : -1;
 }
 
-void event_exit_platform(void) {
-	robust_close(_epollfd); // FIXME: remove remaining events (if any) from epollfd?
+void event_exit_platform(EventLoop *event_loop) {
+	EventLinux *platform = event_loop->platform;
+
+	log_debug("Applied %u and saved %u epollfd modification(s)",
+	          platform->applied_modification_count, platform->saved_modification_count);
+
+	robust_close(platform->epollfd); // FIXME: remove remaining events (if any) from epollfd?
+
+	array_destroy(&platform->received_events, NULL);
+	array_destroy(&platform->pending_modifications, NULL);
+
+	free(platform);
 }
 
-int event_source_added_platform(EventSource *event_source) {
+// adding an event source is not deferred, because the caller has to know if
+// the handle can be used with epoll at all
+int event_source_added_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventLinux *platform = event_loop->platform;
 	struct epoll_event event;
 
 	memset(&event, 0, sizeof(event));
@@ -65,7 +146,7 @@ int event_source_added_platform(EventSource *event_source) {
 	event.events = event_source->events;
 	event.data.ptr = event_source;
 
-	if (epoll_ctl(_epollfd, EPOLL_CTL_ADD, event_source->handle, &event) < 0) {
+	if (epoll_ctl(platform->epollfd, EPOLL_CTL_ADD, event_source->handle, &event) < 0) {
 		log_error("Could not add %s event source (handle: %d) to epollfd: %s (%d)",
 		          event_get_source_type_name(event_source->type, false),
 		          event_source->handle, get_errno_name(errno), errno);
@@ -73,35 +154,79 @@ int event_source_added_platform(EventSource *event_source) {
 		return -1;
 	}
 
-	++_epollfd_event_count;
+	event_source->platform_events = event_source->events;
+	event_source->platform_slot = -1;
+
+	++platform->epollfd_event_count;
 
 	return 0;
 }
 
-int event_source_modified_platform(EventSource *event_source) {
-	struct epoll_event event;
+// modifications are only recorded here and applied by event_apply_modifications
+// right before the next epoll_wait call. this allows to collapse sequences such
+// as adding and removing EVENT_WRITE during the same iteration of the event loop
+// into a single or even no epoll_ctl call at all
+int event_source_modified_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventLinux *platform = event_loop->platform;
+	EventSource **pending_modification;
 
-	event.events = event_source->events;
-	event.data.ptr = event_source;
+	if (event_source->platform_slot == DETACHED_PLATFORM_SLOT) {
+		return 0;
+	}
 
-	if (epoll_ctl(_epollfd, EPOLL_CTL_MOD, event_source->handle, &event) < 0) {
-		log_error("Could not modify %s event source (handle: %d) added to epollfd: %s (%d)",
-		          event_get_source_type_name(event_source->type, false),
-		          event_source->handle, get_errno_name(errno), errno);
+	if (event_source->platform_slot >= 0) {
+		++platform->saved_modification_count;
+
+		return 0;
+	}
+
+	pending_modification = array_append(&platform->pending_modifications);
+
+	if (pending_modification == NULL) {
+		log_error("Could not append to pending modification array: %s (%d)",
+		          get_errno_name(errno), errno);
 
 		return -1;
 	}
 
+	*pending_modification = event_source;
+	event_source->platform_slot = platform->pending_modifications.count - 1;
+
 	return 0;
 }
 
-void event_source_removed_platform(EventSource *event_source) {
+// removing an event source is not deferred, because the handle might be closed
+// and reused for a different event source right after this call
+void event_source_removed_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventLinux *platform = event_loop->platform;
 	struct epoll_event event;
+	EventSource *last_pending_modification;
+
+	if (event_source->platform_slot == DETACHED_PLATFORM_SLOT) {
+		event_source->platform_slot = -1;
+
+		return;
+	}
+
+	// drop pending modification, the event source might be freed before the
+	// next call to event_apply_modifications
+	if (event_source->platform_slot >= 0) {
+		last_pending_modification = *(EventSource **)array_get(&platform->pending_modifications,
+		                                                       platform->pending_modifications.count - 1);
+
+		*(EventSource **)array_get(&platform->pending_modifications, event_source->platform_slot) = last_pending_modification;
+		last_pending_modification->platform_slot = event_source->platform_slot;
+		event_source->platform_slot = -1;
+
+		array_remove(&platform->pending_modifications, platform->pending_modifications.count - 1, NULL);
+
+		++platform->saved_modification_count;
+	}
 
 	event.events = event_source->events;
 	event.data.ptr = event_source;
 
-	if (epoll_ctl(_epollfd, EPOLL_CTL_DEL, event_source->handle, &event) < 0) {
+	if (epoll_ctl(platform->epollfd, EPOLL_CTL_DEL, event_source->handle, &event) < 0) {
 		log_error("Could not remove %s event source (handle: %d) from epollfd: %s (%d)",
 		          event_get_source_type_name(event_source->type, false),
 		          event_source->handle, get_errno_name(errno), errno);
@@ -109,87 +234,165 @@ void event_source_removed_platform(EventSource *event_source) {
 		return;
 	}
 
-	--_epollfd_event_count;
+	--platform->epollfd_event_count;
 }
 
-int event_run_platform(Array *event_sources, bool *running, EventCleanupFunction cleanup) {
-	int result = -1;
+// apply the net result of all modifications since the last call. the caller of
+// event_loop_modify_source already got success reported for them. therefore, an
+// event source whose modification fails is removed from the epollfd and
+// reported as ready with EVENT_ERROR once, so its owner can react to the
+// failure. its previous events cannot be kept, because its functions might
+// already have been changed for the new events. it stays detached and further
+// modifications are ignored until it is removed. without a ready event source
+// array the failed modification stays pending and is retried by the next call
+static void event_apply_modifications(EventLinux *platform, Array *ready_sources) {
 	int i;
+	int pending_count = 0;
 	EventSource *event_source;
-	Array received_events;
-	struct epoll_event *received_event;
-	int ready;
+	EventReadySource *ready_source;
+	struct epoll_event event;
 
-	(void)event_sources;
+	for (i = 0; i < platform->pending_modifications.count; ++i) {
+		event_source = *(EventSource **)array_get(&platform->pending_modifications, i);
+		event_source->platform_slot = -1;
 
-	if (array_create(&received_events, 32, sizeof(struct epoll_event), true) < 0) {
-		log_error("Could not create epoll event array: %s (%d)",
-		          get_errno_name(errno), errno);
+		// an edge-triggered event source is rearmed even if its events did not
+		// change. while its state was modified event_handle_source ignored it
+		// and EPOLL_CTL_MOD makes epoll report it again if it is still ready
+		if (event_source->events == event_source->platform_events &&
+		    (event_source->events & EVENT_EDGE) == 0) {
+			++platform->saved_modification_count;
 
-		return -1;
-	}
+			continue;
+		}
 
-	*running = true;
+		event.events = event_source->events;
+		event.data.ptr = event_source;
 
-	cleanup();
-	event_cleanup_sources();
+		if (epoll_ctl(platform->epollfd, EPOLL_CTL_MOD, event_source->handle, &event) < 0) {
+			log_error("Could not modify %s event source (handle: %d) added to epollfd: %s (%d)",
+			          event_get_source_type_name(event_source->type, false),
+			          event_source->handle, get_errno_name(errno), errno);
 
-	while (*running) {
-		if (array_resize(&received_events, _epollfd_event_count, NULL) < 0) {
-			log_error("Could not resize pollfd array: %s (%d)",
-			          get_errno_name(errno), errno);
+			if (ready_sources == NULL) {
+				*(EventSource **)array_get(&platform->pending_modifications, pending_count) = event_source;
+				event_source->platform_slot = pending_count++;
 
-			goto cleanup;
-		}
+				continue;
+			}
+
+			// the handle might already be closed, then epoll removed it already
+			if (epoll_ctl(platform->epollfd, EPOLL_CTL_DEL, event_source->handle, &event) < 0 &&
+			    errno != EBADF && errno != ENOENT) {
+				log_error("Could not remove %s event source (handle: %d) from epollfd: %s (%d)",
+				          event_get_source_type_name(event_source->type, false),
+				          event_source->handle, get_errno_name(errno), errno);
+			}
+
+			--platform->epollfd_event_count;
 
-		// start to epoll
-		log_event_debug("Starting to epoll on %d event source(s)",
-		                _epollfd_event_count);
+			event_source->platform_events = 0;
+			event_source->platform_slot = DETACHED_PLATFORM_SLOT;
 
-		ready = epoll_wait(_epollfd, (struct epoll_event *)received_events.bytes,
-		                   received_events.count, -1);
+			ready_source = array_append(ready_sources);
 
-		if (ready < 0) {
-			if (errno_interrupted()) {
-				log_debug("EPoll got interrupted");
+			if (ready_source == NULL) {
+				log_error("Could not append to ready event source array: %s (%d)",
+				          get_errno_name(errno), errno);
 
 				continue;
 			}
 
-			log_error("Count not epoll on event source(s): %s (%d)",
-			          get_errno_name(errno), errno);
+			ready_source->event_source = event_source;
+			ready_source->received_events = EVENT_ERROR;
 
-			goto cleanup;
+			continue;
 		}
 
-		// handle poll result
-		log_event_debug("EPoll returned %d event source(s) as ready", ready);
+		event_source->platform_events = event_source->events;
+
+		++platform->applied_modification_count;
+	}
+
+	array_resize(&platform->pending_modifications, pending_count, NULL);
+}
+
+// the epollfd becomes readable if any of its event sources is ready
+IOHandle event_get_handle_platform(EventLoop *event_loop) {
+	EventLinux *platform = event_loop->platform;
+
+	return platform->epollfd;
+}
+
+// make the epollfd reflect the current events of all event sources before it
+// is waited on by someone else
+int event_flush_platform(EventLoop *event_loop) {
+	event_apply_modifications(event_loop->platform, NULL);
 
-		// this loop assumes that event sources stored in the epoll events
-		// are valid. because of this event_remove_source only marks event
-		// sources as removed, the actual removal is done after this loop
-		// by event_cleanup_sources
-		for (i = 0; *running && i < ready; ++i) {
-			received_event = array_get(&received_events, i);
-			event_source = received_event->data.ptr;
+	return 0;
+}
+
+int event_wait_platform(EventLoop *event_loop, int timeout, Array *ready_sources) {
+	EventLinux *platform = event_loop->platform;
+	int i;
+	struct epoll_event *received_event;
+	EventReadySource *ready_source;
+	int ready;
+
+	event_apply_modifications(platform, ready_sources);
+
+	// don't block if a failed modification already made an event source ready
+	if (ready_sources->count > 0) {
+		timeout = 0;
+	}
+
+	if (array_resize(&platform->received_events, platform->epollfd_event_count, NULL) < 0) {
+		log_error("Could not resize epoll event array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	// start to epoll
+	log_event_debug("Starting to epoll on %d event source(s)",
+	                platform->epollfd_event_count);
+
+	ready = epoll_wait(platform->epollfd, (struct epoll_event *)platform->received_events.bytes,
+	                   platform->received_events.count, timeout);
+
+	if (ready < 0) {
+		if (errno_interrupted()) {
+			log_debug("EPoll got interrupted");
 
-			event_handle_source(event_source, received_event->events);
+			return 0;
 		}
 
-		log_event_debug("Handled all ready event sources");
+		log_error("Count not epoll on event source(s): %s (%d)",
+		          get_errno_name(errno), errno);
 
-		// now cleanup event sources that got marked as disconnected/removed
-		// during the event handling
-		cleanup();
-		event_cleanup_sources();
+		return -1;
 	}
 
-	result = 0;
+	log_event_debug("EPoll returned %d event source(s) as ready", ready);
 
-cleanup:
-	*running = false;
+	// the event sources stored in the epoll events stay valid until the
+	// ready event sources are handled, because event_remove_source only
+	// marks event sources as removed, the actual removal is done afterwards
+	// by event_cleanup_sources
+	for (i = 0; i < ready; ++i) {
+		received_event = array_get(&platform->received_events, i);
+		ready_source = array_append(ready_sources);
 
-	array_destroy(&received_events, NULL);
+		if (ready_source == NULL) {
+			log_error("Could not append to ready event source array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
 
-	return result;
+		ready_source->event_source = received_event->data.ptr;
+		ready_source->received_events = received_event->events;
+	}
+
+	return 0;
 }
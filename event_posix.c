@@ -21,6 +21,8 @@
 
 #include <errno.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "event.h"
 
@@ -30,129 +32,214 @@
 
 static LogSource _log_source = LOG_SOURCE_INITIALIZER;
 
-int event_init_platform(void) {
-	return 0;
-}
+// the pollfd array is kept in sync with the event sources by the platform
+// hooks. each event source that is not removed has a pollfd at the index
+// stored in its platform_slot. the polled sources array stores the matching
+// event source for each pollfd
+typedef struct {
+	Array pollfds;
+	Array polled_sources; // EventSource pointers
+} EventPOSIX;
 
-void event_exit_platform(void) {
-}
+int event_init_platform(EventLoop *event_loop) {
+	int phase = 0;
+	EventPOSIX *platform;
 
-int event_source_added_platform(EventSource *event_source) {
-	(void)event_source;
+	// allocate platform data
+	platform = calloc(1, sizeof(EventPOSIX));
 
-	return 0;
-}
+	if (platform == NULL) {
+		errno = ENOMEM;
 
-int event_source_modified_platform(EventSource *event_source) {
-	(void)event_source;
+		log_error("Could not allocate poll event loop: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	return 0;
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	// create pollfd array
+	if (array_create(&platform->pollfds, 32, sizeof(struct pollfd), true) < 0) {
+		log_error("Could not create pollfd array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	// create polled event source array
+	if (array_create(&platform->polled_sources, 32, sizeof(EventSource *), true) < 0) {
+		log_error("Could not create polled event source array: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	event_loop->platform = platform;
+
+	phase = 3;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 2:
+		array_destroy(&platform->pollfds, NULL);
+		// fall through
+
+	case 1:
+		free(platform);
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 3 ? 0 : -1;
 }
 
-void event_source_removed_platform(EventSource *event_source) {
-	(void)event_source;
+void event_exit_platform(EventLoop *event_loop) {
+	EventPOSIX *platform = event_loop->platform;
+
+	array_destroy(&platform->polled_sources, NULL);
+	array_destroy(&platform->pollfds, NULL);
+
+	free(platform);
 }
 
-int event_run_platform(Array *event_sources, bool *running, EventCleanupFunction cleanup) {
-	int result = -1;
-	Array pollfds;
-	int i;
-	EventSource *event_source;
+int event_source_added_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventPOSIX *platform = event_loop->platform;
 	struct pollfd *pollfd;
-	int ready;
-	int handled;
+	EventSource **polled_source;
 
-	// create pollfd array
-	if (array_create(&pollfds, 32, sizeof(struct pollfd), true) < 0) {
-		log_error("Could not create pollfd array: %s (%d)",
+	pollfd = array_append(&platform->pollfds);
+
+	if (pollfd == NULL) {
+		log_error("Could not append to pollfd array: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		return -1;
 	}
 
-	*running = true;
+	polled_source = array_append(&platform->polled_sources);
 
-	cleanup();
-	event_cleanup_sources();
+	if (polled_source == NULL) {
+		log_error("Could not append to polled event source array: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	while (*running) {
-		// update pollfd array
-		if (array_resize(&pollfds, event_sources->count, NULL) < 0) {
-			log_error("Could not resize pollfd array: %s (%d)",
-			          get_errno_name(errno), errno);
+		array_remove(&platform->pollfds, platform->pollfds.count - 1, NULL);
 
-			goto cleanup;
-		}
+		return -1;
+	}
 
-		for (i = 0; i < event_sources->count; ++i) {
-			event_source = array_get(event_sources, i);
-			pollfd = array_get(&pollfds, i);
+	pollfd->fd = event_source->handle;
+	pollfd->events = event_source->events & ~EVENT_EDGE; // poll is level-triggered only
+	pollfd->revents = 0;
 
-			pollfd->fd = event_source->handle;
-			pollfd->events = event_source->events;
-			pollfd->revents = 0;
-		}
+	*polled_source = event_source;
+	event_source->platform_slot = platform->pollfds.count - 1;
+
+	return 0;
+}
 
-		// start to poll
-		log_event_debug("Starting to poll on %d event source(s)", pollfds.count);
+int event_source_modified_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventPOSIX *platform = event_loop->platform;
+	struct pollfd *pollfd = array_get(&platform->pollfds, event_source->platform_slot);
 
-		ready = poll((struct pollfd *)pollfds.bytes, pollfds.count, -1);
+	pollfd->events = event_source->events & ~EVENT_EDGE; // poll is level-triggered only
 
-		if (ready < 0) {
-			if (errno_interrupted()) {
-				log_debug("Poll got interrupted");
+	return 0;
+}
 
-				continue;
-			}
+// the last pollfd is moved into the slot of the removed event source. this
+// does not affect the handling of the current iteration, because the ready
+// event sources are collected before they are handled
+void event_source_removed_platform(EventLoop *event_loop, EventSource *event_source) {
+	EventPOSIX *platform = event_loop->platform;
+	int slot = event_source->platform_slot;
+	int last = platform->pollfds.count - 1;
+	EventSource *last_source;
 
-			log_error("Count not poll on event source(s): %s (%d)",
-			          get_errno_name(errno), errno);
+	if (slot != last) {
+		last_source = *(EventSource **)array_get(&platform->polled_sources, last);
 
-			goto cleanup;
-		}
+		memcpy(array_get(&platform->pollfds, slot), array_get(&platform->pollfds, last),
+		       sizeof(struct pollfd));
 
-		// handle poll result
-		log_event_debug("Poll returned %d event source(s) as ready", ready);
+		*(EventSource **)array_get(&platform->polled_sources, slot) = last_source;
+		last_source->platform_slot = slot;
+	}
 
-		handled = 0;
+	array_remove(&platform->pollfds, last, NULL);
+	array_remove(&platform->polled_sources, last, NULL);
 
-		// this loop assumes that event source array and pollfd array can be
-		// matched by index. this means that the first N items of the event
-		// source array (with N = items in pollfd array) are not removed
-		// or replaced during the iteration over the pollfd array. because
-		// of this event_remove_source only marks event sources as removed,
-		// the actual removal is done after this loop by event_cleanup_sources
-		for (i = 0; *running && i < pollfds.count && ready > handled; ++i) {
-			pollfd = array_get(&pollfds, i);
+	event_source->platform_slot = -1;
+}
 
-			if (pollfd->revents == 0) {
-				continue;
-			}
+// poll has no handle that could be waited on instead of the pollfds
+IOHandle event_get_handle_platform(EventLoop *event_loop) {
+	(void)event_loop;
 
-			event_handle_source(array_get(event_sources, i), pollfd->revents);
+	return IO_HANDLE_INVALID;
+}
 
-			++handled;
-		}
+int event_flush_platform(EventLoop *event_loop) {
+	(void)event_loop;
+
+	return 0;
+}
 
-		if (ready == handled) {
-			log_event_debug("Handled all ready event sources");
-		} else if (*running) {
-			log_warn("Handled only %d of %d ready event source(s)",
-			         handled, ready);
+int event_wait_platform(EventLoop *event_loop, int timeout, Array *ready_sources) {
+	EventPOSIX *platform = event_loop->platform;
+	int i;
+	struct pollfd *pollfd;
+	EventReadySource *ready_source;
+	int ready;
+
+	// start to poll
+	log_event_debug("Starting to poll on %d event source(s)", platform->pollfds.count);
+
+	ready = poll((struct pollfd *)platform->pollfds.bytes, platform->pollfds.count, timeout);
+
+	if (ready < 0) {
+		if (errno_interrupted()) {
+			log_debug("Poll got interrupted");
+
+			return 0;
 		}
 
-		// now cleanup event sources that got marked as disconnected/removed
-		// during the event handling
-		cleanup();
-		event_cleanup_sources();
+		log_error("Count not poll on event source(s): %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
 	}
 
-	result = 0;
+	log_event_debug("Poll returned %d event source(s) as ready", ready);
 
-cleanup:
-	*running = false;
+	for (i = 0; i < platform->pollfds.count && ready_sources->count < ready; ++i) {
+		pollfd = array_get(&platform->pollfds, i);
+
+		if (pollfd->revents == 0) {
+			continue;
+		}
 
-	array_destroy(&pollfds, NULL);
+		ready_source = array_append(ready_sources);
 
-	return result;
+		if (ready_source == NULL) {
+			log_error("Could not append to ready event source array: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return -1;
+		}
+
+		ready_source->event_source = *(EventSource **)array_get(&platform->polled_sources, i);
+		ready_source->received_events = pollfd->revents;
+	}
+
+	if (ready_sources->count < ready) {
+		log_warn("Found only %d of %d ready event source(s)",
+		         ready_sources->count, ready);
+	}
+
+	return 0;
 }
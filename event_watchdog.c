@@ -0,0 +1,384 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_watchdog.c: Detects event handlers that block the event loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * while an event watchdog is attached the event loop stores the handle, type
+ * and a copy of the name of the event source and the start time before each
+ * dispatch and clears the start time after it. the watchdog thread wakes up
+ * twice per threshold and compares the start time with the current time. the
+ * handle, type and name are only used if the start time did not change while
+ * reading them. the event source itself is never read from the watchdog
+ * thread, because it might be removed and its name freed at any time.
+ *
+ * to record a backtrace the watchdog thread sends SIGURG to the event loop
+ * thread. SIGURG is ignored by default, so a late signal after the watchdog
+ * got destroyed is harmless. the signal handler only stores the return
+ * addresses, they are symbolized and logged by the watchdog thread. this is
+ * only supported with glibc.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#ifdef __GLIBC__
+	#include <execinfo.h>
+	#include <stdlib.h>
+#endif
+
+#include "event_watchdog.h"
+
+#include "log.h"
+#include "utils.h"
+
+static LogSource _log_source = LOG_SOURCE_INITIALIZER;
+
+#ifdef __GLIBC__
+
+#define MAX_BACKTRACE_FRAMES 32
+#define BACKTRACE_TIMEOUT 100 // milliseconds
+
+// only one backtrace is recorded at a time, even with multiple watchdogs
+static Mutex _backtrace_mutex = { PTHREAD_MUTEX_INITIALIZER };
+static int _backtrace_users = 0; // protected by the backtrace mutex
+static struct sigaction _previous_sigurg_action; // protected by the backtrace mutex
+static void *_backtrace_frames[MAX_BACKTRACE_FRAMES];
+static int _backtrace_frame_count = -1; // -1 while no backtrace was recorded
+
+static void event_watchdog_record_backtrace(int signal_number) {
+	int saved_errno = errno;
+
+	(void)signal_number;
+
+	__atomic_store_n(&_backtrace_frame_count,
+	                 backtrace(_backtrace_frames, MAX_BACKTRACE_FRAMES), __ATOMIC_RELEASE);
+
+	errno = saved_errno;
+}
+
+// sets errno on error
+static int event_watchdog_install_signal_handler(void) {
+	struct sigaction action;
+	void *frame;
+	int rc = 0;
+
+	mutex_lock(&_backtrace_mutex);
+
+	if (_backtrace_users == 0) {
+		// the first call of backtrace might allocate memory to load libgcc,
+		// which is not allowed in a signal handler. do it here instead
+		backtrace(&frame, 1);
+
+		memset(&action, 0, sizeof(action));
+
+		action.sa_handler = event_watchdog_record_backtrace;
+		action.sa_flags = SA_RESTART;
+
+		sigemptyset(&action.sa_mask);
+
+		rc = sigaction(SIGURG, &action, &_previous_sigurg_action);
+	}
+
+	if (rc == 0) {
+		++_backtrace_users;
+	}
+
+	mutex_unlock(&_backtrace_mutex);
+
+	return rc;
+}
+
+static void event_watchdog_uninstall_signal_handler(void) {
+	mutex_lock(&_backtrace_mutex);
+
+	if (--_backtrace_users == 0) {
+		sigaction(SIGURG, &_previous_sigurg_action, NULL);
+	}
+
+	mutex_unlock(&_backtrace_mutex);
+}
+
+static void event_watchdog_log_backtrace(EventWatchdog *watchdog) {
+	int rc;
+	int i;
+	int frame_count = -1;
+	char **symbols;
+
+	mutex_lock(&_backtrace_mutex);
+
+	__atomic_store_n(&_backtrace_frame_count, -1, __ATOMIC_RELAXED);
+
+	rc = pthread_kill(watchdog->event_thread, SIGURG);
+
+	if (rc != 0) {
+		log_error("Could not send SIGURG to event loop thread: %s (%d)",
+		          get_errno_name(rc), rc);
+
+		goto cleanup;
+	}
+
+	// the event loop thread might be blocked in a way that delays the signal
+	for (i = 0; i < BACKTRACE_TIMEOUT; ++i) {
+		frame_count = __atomic_load_n(&_backtrace_frame_count, __ATOMIC_ACQUIRE);
+
+		if (frame_count >= 0) {
+			break;
+		}
+
+		poll(NULL, 0, 1);
+	}
+
+	if (frame_count < 0) {
+		log_warn("Event loop thread did not record a backtrace within %d msec",
+		         BACKTRACE_TIMEOUT);
+
+		goto cleanup;
+	}
+
+	symbols = backtrace_symbols(_backtrace_frames, frame_count);
+
+	if (symbols == NULL) {
+		log_error("Could not symbolize backtrace of event loop thread: %s (%d)",
+		          get_errno_name(ENOMEM), ENOMEM);
+
+		goto cleanup;
+	}
+
+	// skip the signal handler and the signal trampoline
+	for (i = 2; i < frame_count; ++i) {
+		log_warn("  #%d %s", i - 2, symbols[i]);
+	}
+
+	free(symbols);
+
+cleanup:
+	mutex_unlock(&_backtrace_mutex);
+}
+
+#endif
+
+// the dispatch start is read before and after the handle, type and name. if it
+// did not change in between then they belong to this dispatch
+static void event_watchdog_check(EventWatchdog *watchdog) {
+	EventLoop *event_loop = watchdog->event_loop;
+	uint64_t start;
+	uint64_t now;
+	IOHandle handle;
+	EventSourceType type;
+	char name[sizeof(event_loop->dispatch_name)];
+
+	start = __atomic_load_n(&event_loop->dispatch_start, __ATOMIC_ACQUIRE);
+	now = microtime();
+
+	if (watchdog->reported_start != 0 && start != watchdog->reported_start) {
+		log_warn("Event loop got unstuck after about %"PRIu64" msec",
+		         (now - watchdog->reported_start) / 1000);
+
+		watchdog->reported_start = 0;
+	}
+
+	if (start == 0 || start == watchdog->reported_start || now < start ||
+	    now - start < watchdog->threshold) {
+		return;
+	}
+
+	handle = __atomic_load_n(&event_loop->dispatch_handle, __ATOMIC_RELAXED);
+	type = __atomic_load_n(&event_loop->dispatch_type, __ATOMIC_RELAXED);
+
+	// the copy might be torn if the next dispatch starts meanwhile, then the
+	// start time changed and the copy is discarded below
+	memcpy(name, event_loop->dispatch_name, sizeof(name));
+
+	name[sizeof(name) - 1] = '\0';
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&event_loop->dispatch_start, __ATOMIC_RELAXED) != start) {
+		return; // the dispatch finished while the handle, type and name were read
+	}
+
+	watchdog->reported_start = start;
+
+	if (handle != IO_HANDLE_INVALID) {
+		log_warn("Event loop is stuck in %s event source (handle: %d, name: %s) for %"PRIu64" msec",
+		         event_get_source_type_name(type, false), handle, name, (now - start) / 1000);
+	} else {
+		log_warn("Event loop is stuck in a deadline or deferred function (name: %s) for %"PRIu64" msec",
+		         name, (now - start) / 1000);
+	}
+
+#ifdef __GLIBC__
+	if (watchdog->backtrace) {
+		event_watchdog_log_backtrace(watchdog);
+	}
+#endif
+}
+
+static void event_watchdog_thread(void *opaque) {
+	EventWatchdog *watchdog = opaque;
+	struct pollfd pollfd;
+	int timeout;
+	int ready;
+
+	pollfd.fd = notifier_get_handle(&watchdog->stop_notifier);
+	pollfd.events = POLLIN;
+
+	// check twice per threshold, a stall is reported at most half a threshold late
+	timeout = (int)(watchdog->threshold / 2000);
+
+	if (timeout < 1) {
+		timeout = 1;
+	}
+
+	for (;;) {
+		ready = poll(&pollfd, 1, timeout);
+
+		if (ready < 0) {
+			if (errno_interrupted()) {
+				continue;
+			}
+
+			log_error("Could not poll on stop notifier of event watchdog: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			break;
+		}
+
+		if (ready > 0) {
+			break;
+		}
+
+		event_watchdog_check(watchdog);
+	}
+}
+
+int event_watchdog_create(EventWatchdog *watchdog, EventLoop *event_loop,
+                          uint64_t threshold, bool backtrace) { // microseconds
+	int phase = 0;
+#ifdef __GLIBC__
+	sigset_t signal_mask;
+	int rc;
+#endif
+
+	if (event_loop->watched) {
+		log_error("Event loop is already observed by another event watchdog");
+
+		return -1;
+	}
+
+	watchdog->event_loop = event_loop;
+	watchdog->threshold = threshold;
+	watchdog->backtrace = backtrace;
+	watchdog->event_thread = pthread_self();
+	watchdog->reported_start = 0;
+
+#ifdef __GLIBC__
+	if (backtrace) {
+		if (event_watchdog_install_signal_handler() < 0) {
+			log_error("Could not install SIGURG handler: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+
+		// the event loop thread might have inherited a signal mask that blocks
+		// SIGURG. it stays unblocked after the watchdog got destroyed, this is
+		// harmless because SIGURG is ignored by default
+		sigemptyset(&signal_mask);
+		sigaddset(&signal_mask, SIGURG);
+
+		rc = pthread_sigmask(SIG_UNBLOCK, &signal_mask, NULL);
+
+		if (rc != 0) {
+			errno = rc;
+
+			log_error("Could not unblock SIGURG: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			event_watchdog_uninstall_signal_handler();
+
+			goto cleanup;
+		}
+	}
+#else
+	if (backtrace) {
+		log_warn("Backtraces are not supported on this platform");
+
+		watchdog->backtrace = false;
+	}
+#endif
+
+	phase = 1;
+
+	if (notifier_create(&watchdog->stop_notifier) < 0) {
+		log_error("Could not create stop notifier of event watchdog: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	event_loop->watched = true;
+
+	thread_create(&watchdog->thread, event_watchdog_thread, watchdog);
+
+	log_debug("Started event watchdog with a threshold of %"PRIu64" msec", threshold / 1000);
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 1:
+#ifdef __GLIBC__
+		if (watchdog->backtrace) {
+			event_watchdog_uninstall_signal_handler();
+		}
+#endif
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 2 ? 0 : -1;
+}
+
+void event_watchdog_destroy(EventWatchdog *watchdog) {
+	if (notifier_signal(&watchdog->stop_notifier) < 0) {
+		log_error("Could not signal stop notifier of event watchdog: %s (%d)",
+		          get_errno_name(errno), errno);
+	}
+
+	thread_join(&watchdog->thread);
+	thread_destroy(&watchdog->thread);
+
+	notifier_destroy(&watchdog->stop_notifier);
+
+	watchdog->event_loop->watched = false;
+
+#ifdef __GLIBC__
+	if (watchdog->backtrace) {
+		event_watchdog_uninstall_signal_handler();
+	}
+#endif
+
+	log_debug("Stopped event watchdog");
+}
@@ -0,0 +1,54 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * event_watchdog.h: Detects event handlers that block the event loop
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DAEMONLIB_EVENT_WATCHDOG_H
+#define DAEMONLIB_EVENT_WATCHDOG_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "event.h"
+#include "notifier.h"
+#include "threads.h"
+
+// the event watchdog observes an event loop from its own thread. it logs the
+// event source whose handling takes longer than the threshold and optionally
+// a backtrace of the stuck event loop thread. recording a backtrace signals
+// the event loop thread, this makes system calls that are not restarted
+// automatically, such as poll or nanosleep, fail with EINTR. the event
+// watchdog has to be created and destroyed on the thread that runs the event
+// loop
+typedef struct {
+	EventLoop *event_loop;
+	uint64_t threshold; // in microseconds
+	bool backtrace;
+	pthread_t event_thread;
+	Thread thread;
+	Notifier stop_notifier;
+	uint64_t reported_start; // dispatch start of the last reported stall, 0 if none
+} EventWatchdog;
+
+int event_watchdog_create(EventWatchdog *watchdog, EventLoop *event_loop,
+                          uint64_t threshold, bool backtrace); // microseconds
+void event_watchdog_destroy(EventWatchdog *watchdog);
+
+#endif // DAEMONLIB_EVENT_WATCHDOG_H
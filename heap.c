@@ -0,0 +1,172 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * heap.c: Min-heap specific functions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * a Heap object keeps nodes ordered by their key, the node with the smallest
+ * key is at the top. the heap does not own the nodes, they are embedded into
+ * the structs that are kept in the heap. each node knows its own index in the
+ * heap, this allows to update and remove any node in O(log n).
+ */
+
+#include "heap.h"
+
+static HeapNode *heap_get(Heap *heap, int index) {
+	return *(HeapNode **)array_get(&heap->nodes, index);
+}
+
+static void heap_set(Heap *heap, int index, HeapNode *node) {
+	*(HeapNode **)array_get(&heap->nodes, index) = node;
+	node->index = index;
+}
+
+static void heap_sift_up(Heap *heap, int index) {
+	HeapNode *node = heap_get(heap, index);
+	HeapNode *parent;
+
+	while (index > 0) {
+		parent = heap_get(heap, (index - 1) / 2);
+
+		if (parent->key <= node->key) {
+			break;
+		}
+
+		heap_set(heap, index, parent);
+
+		index = (index - 1) / 2;
+	}
+
+	heap_set(heap, index, node);
+}
+
+static void heap_sift_down(Heap *heap, int index) {
+	HeapNode *node = heap_get(heap, index);
+	HeapNode *child;
+	int child_index;
+
+	for (;;) {
+		child_index = index * 2 + 1;
+
+		if (child_index >= heap->nodes.count) {
+			break;
+		}
+
+		child = heap_get(heap, child_index);
+
+		if (child_index + 1 < heap->nodes.count &&
+		    heap_get(heap, child_index + 1)->key < child->key) {
+			++child_index;
+			child = heap_get(heap, child_index);
+		}
+
+		if (node->key <= child->key) {
+			break;
+		}
+
+		heap_set(heap, index, child);
+
+		index = child_index;
+	}
+
+	heap_set(heap, index, node);
+}
+
+// sets errno on error
+int heap_create(Heap *heap, int reserve) {
+	return array_create(&heap->nodes, reserve, sizeof(HeapNode *), true);
+}
+
+// nodes that are still in the heap are marked as not in a heap
+void heap_destroy(Heap *heap) {
+	int i;
+
+	for (i = 0; i < heap->nodes.count; ++i) {
+		heap_get(heap, i)->index = -1;
+	}
+
+	array_destroy(&heap->nodes, NULL);
+}
+
+void heap_init_node(HeapNode *node) {
+	node->index = -1;
+	node->key = 0;
+}
+
+// pushing a node that is already in the heap only updates its key. this
+// cannot fail, because the node already has its place in the heap.
+// sets errno on error
+int heap_push(Heap *heap, HeapNode *node, uint64_t key) {
+	if (node->index >= 0) {
+		heap_update(heap, node, key);
+
+		return 0;
+	}
+
+	if (array_append(&heap->nodes) == NULL) {
+		return -1;
+	}
+
+	node->key = key;
+
+	heap_set(heap, heap->nodes.count - 1, node);
+	heap_sift_up(heap, node->index);
+
+	return 0;
+}
+
+// the node has to be in the heap
+void heap_update(Heap *heap, HeapNode *node, uint64_t key) {
+	uint64_t previous_key = node->key;
+
+	node->key = key;
+
+	if (key < previous_key) {
+		heap_sift_up(heap, node->index);
+	} else {
+		heap_sift_down(heap, node->index);
+	}
+}
+
+// the node has to be in the heap
+void heap_remove(Heap *heap, HeapNode *node) {
+	int index = node->index;
+	HeapNode *last = heap_get(heap, heap->nodes.count - 1);
+
+	node->index = -1;
+
+	array_remove(&heap->nodes, heap->nodes.count - 1, NULL);
+
+	if (last == node) {
+		return;
+	}
+
+	heap_set(heap, index, last);
+	heap_sift_up(heap, index);
+	heap_sift_down(heap, last->index);
+}
+
+// returns the node with the smallest key, or NULL if the heap is empty
+HeapNode *heap_peek(Heap *heap) {
+	if (heap->nodes.count == 0) {
+		return NULL;
+	}
+
+	return heap_get(heap, 0);
+}
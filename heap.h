@@ -0,0 +1,51 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * heap.h: Min-heap specific functions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DAEMONLIB_HEAP_H
+#define DAEMONLIB_HEAP_H
+
+#include <stdint.h>
+
+#include "array.h"
+
+// a heap node is embedded into the struct that is kept in the heap, use
+// containerof to get from the node to its struct
+typedef struct {
+	int index; // -1 if not in a heap
+	uint64_t key;
+} HeapNode;
+
+typedef struct {
+	Array nodes; // HeapNode pointers, ordered by key
+} Heap;
+
+int heap_create(Heap *heap, int reserve);
+void heap_destroy(Heap *heap);
+
+void heap_init_node(HeapNode *node);
+
+int heap_push(Heap *heap, HeapNode *node, uint64_t key);
+void heap_update(Heap *heap, HeapNode *node, uint64_t key);
+void heap_remove(Heap *heap, HeapNode *node);
+
+HeapNode *heap_peek(Heap *heap);
+
+#endif // DAEMONLIB_HEAP_H
@@ -81,4 +81,10 @@
 		((type *)((char *)(ptr) - offsetof(type, member)))
 #endif
 
+#ifdef _MSC_VER
+	#define THREAD_LOCAL __declspec(thread)
+#else
+	#define THREAD_LOCAL __thread
+#endif
+
 #endif // DAEMONLIB_MACROS_H
@@ -0,0 +1,50 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * notifier.h: Notifier specific functions
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DAEMONLIB_NOTIFIER_H
+#define DAEMONLIB_NOTIFIER_H
+
+#include "io.h"
+#ifndef __linux__
+	#include "pipe.h"
+#endif
+
+// a notifier wakes up the event loop from another thread or from a signal
+// handler. its handle becomes readable when the notifier gets signaled and
+// stays readable until the notifier gets reset. multiple signals before a
+// reset collapse into one wakeup
+typedef struct {
+#ifdef __linux__
+	IOHandle handle; // eventfd
+#else
+	Pipe pipe;
+#endif
+} Notifier;
+
+int notifier_create(Notifier *notifier);
+void notifier_destroy(Notifier *notifier);
+
+IOHandle notifier_get_handle(Notifier *notifier);
+
+int notifier_signal(Notifier *notifier);
+int notifier_reset(Notifier *notifier);
+
+#endif // DAEMONLIB_NOTIFIER_H
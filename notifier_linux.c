@@ -0,0 +1,80 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * notifier_linux.c: eventfd based notifier implementation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * an eventfd is a single file descriptor with a 64-bit counter. signaling
+ * adds 1 to the counter, resetting reads and clears it. compared to a pipe this
+ * needs half the file descriptors and no kernel buffer.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+
+#include "notifier.h"
+
+#include "utils.h"
+
+// sets errno on error
+int notifier_create(Notifier *notifier) {
+	notifier->handle = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (notifier->handle < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void notifier_destroy(Notifier *notifier) {
+	robust_close(notifier->handle);
+}
+
+IOHandle notifier_get_handle(Notifier *notifier) {
+	return notifier->handle;
+}
+
+// can be called from a signal handler. sets errno on error
+int notifier_signal(Notifier *notifier) {
+	uint64_t value = 1;
+
+	if (robust_write(notifier->handle, &value, sizeof(value)) < 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+// returns the number of signals since the last reset, 0 if there was none.
+// sets errno on error
+int notifier_reset(Notifier *notifier) {
+	uint64_t value;
+
+	if (robust_read(notifier->handle, &value, sizeof(value)) < 0) {
+		if (errno_would_block()) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	return value > INT32_MAX ? INT32_MAX : (int)value;
+}
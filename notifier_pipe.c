@@ -0,0 +1,87 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * notifier_pipe.c: Pipe based notifier implementation
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * signaling writes a byte to the pipe, resetting reads all bytes from it. the
+ * write end is non-blocking: if the pipe is full then the notifier is already
+ * signaled and the byte can be dropped.
+ */
+
+#include <stdint.h>
+
+#include "notifier.h"
+
+#include "utils.h"
+
+// sets errno on error
+int notifier_create(Notifier *notifier) {
+	return pipe_create(&notifier->pipe, PIPE_FLAG_NON_BLOCKING_READ |
+	                                    PIPE_FLAG_NON_BLOCKING_WRITE);
+}
+
+void notifier_destroy(Notifier *notifier) {
+	pipe_destroy(&notifier->pipe);
+}
+
+IOHandle notifier_get_handle(Notifier *notifier) {
+	return notifier->pipe.base.read_handle;
+}
+
+// can be called from a signal handler. sets errno on error
+int notifier_signal(Notifier *notifier) {
+	uint8_t byte = 0;
+
+	if (pipe_write(&notifier->pipe, &byte, sizeof(byte)) < 0) {
+		if (errno_would_block()) {
+			return 0;
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// returns the number of signals since the last reset, 0 if there was none.
+// sets errno on error
+int notifier_reset(Notifier *notifier) {
+	uint8_t buffer[64];
+	int rc;
+	int count = 0;
+
+	for (;;) {
+		rc = pipe_read(&notifier->pipe, buffer, sizeof(buffer));
+
+		if (rc < 0) {
+			if (errno_would_block()) {
+				return count;
+			}
+
+			return -1;
+		}
+
+		if (rc == 0) { // write end got closed
+			return count;
+		}
+
+		count += rc;
+	}
+}
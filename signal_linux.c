@@ -0,0 +1,451 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * signal_linux.c: signalfd based signal handling
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * the handled signals are blocked and received through a signalfd that is
+ * registered as event source. blocked signals are only delivered through the
+ * signalfd if all threads block them. the calling thread of signal_init blocks
+ * them here and threads created afterwards inherit its signal mask.
+ * thread_create blocks the handled signals in the threads it creates as well.
+ *
+ * threads created before signal_init or by other libraries might not block
+ * the handled signals. a signal delivered to such a thread would take its
+ * default action and terminate the process. therefore, signal handlers are
+ * installed as a fallback. they forward the signal through a notifier to the
+ * same dispatching as the signalfd. signals that were ignored before
+ * signal_init stay ignored, as they would never reach the signalfd either.
+ *
+ * a child process inherits the signal mask of the thread that forked it and
+ * keeps it across exec. therefore, a fork handler saves the signal mask of the
+ * forking thread and restores it in the child with the handled signals reset
+ * to their state from before signal_init. the fallback signal handlers are
+ * reset in the child as well, they would forward to the notifier of the
+ * parent otherwise. a process that should keep handling signals in a forked
+ * child, such as a daemon, has to fork before signal_init.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/signalfd.h>
+
+#include "signal.h"
+
+#include "event.h"
+#include "log.h"
+#include "macros.h"
+#include "notifier.h"
+#include "utils.h"
+
+static LogSource _log_source = LOG_SOURCE_INITIALIZER;
+
+#define MAX_SIGNALS_PER_READ 16
+#define HANDLED_SIGNAL_COUNT 4
+
+static const int _handled_signals[HANDLED_SIGNAL_COUNT] = { SIGINT, SIGTERM, SIGHUP, SIGUSR1 };
+
+static int _signalfd;
+static sigset_t _previous_signal_mask;
+static bool _signals_blocked = false;
+static bool _fork_handler_installed = false;
+static THREAD_LOCAL sigset_t _forking_signal_mask;
+static THREAD_LOCAL bool _forking_with_signals_blocked;
+static Notifier _forward_notifier;
+static struct sigaction _previous_actions[HANDLED_SIGNAL_COUNT];
+static bool _forward_handlers_installed[HANDLED_SIGNAL_COUNT];
+static volatile sig_atomic_t _forwarded_signals[HANDLED_SIGNAL_COUNT];
+static volatile sig_atomic_t _forwarded_sender_pids[HANDLED_SIGNAL_COUNT];
+static SIGHUPFunction _handle_sighup;
+static SIGUSR1Function _handle_sigusr1;
+
+static void signal_dispatch(struct signalfd_siginfo *info) {
+	int signal_number = (int)info->ssi_signo;
+
+	if (signal_number == SIGINT) {
+		log_info("Received SIGINT (sender-pid: %u)", info->ssi_pid);
+
+		event_stop();
+	} else if (signal_number == SIGTERM) {
+		log_info("Received SIGTERM (sender-pid: %u)", info->ssi_pid);
+
+		event_stop();
+	} else if (signal_number == SIGHUP) {
+		log_info("Received SIGHUP (sender-pid: %u)", info->ssi_pid);
+
+		if (_handle_sighup != NULL) {
+			_handle_sighup();
+		}
+	} else if (signal_number == SIGUSR1) {
+		log_info("Received SIGUSR1 (sender-pid: %u)", info->ssi_pid);
+
+		if (_handle_sigusr1 != NULL) {
+			_handle_sigusr1();
+		}
+	} else {
+		log_warn("Received unexpected signal %d (sender-pid: %u)",
+		         signal_number, info->ssi_pid);
+	}
+}
+
+static void signal_handle(void *opaque) {
+	struct signalfd_siginfo infos[MAX_SIGNALS_PER_READ];
+	int rc;
+	int count;
+	int i;
+
+	(void)opaque;
+
+	do {
+		rc = robust_read(_signalfd, infos, sizeof(infos));
+
+		if (rc < 0) {
+			if (errno_would_block()) {
+				return;
+			}
+
+			log_error("Could not read from signalfd: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			return;
+		}
+
+		count = rc / (int)sizeof(struct signalfd_siginfo);
+
+		for (i = 0; i < count; ++i) {
+			signal_dispatch(&infos[i]);
+		}
+	} while (count == MAX_SIGNALS_PER_READ);
+}
+
+static void signal_handle_forwarded(void *opaque) {
+	struct signalfd_siginfo info;
+	int i;
+
+	(void)opaque;
+
+	// reset the notifier before checking the flags. a signal that arrives
+	// after a flag was checked then signals the notifier again
+	if (notifier_reset(&_forward_notifier) < 0) {
+		log_error("Could not reset signal forward notifier: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return;
+	}
+
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		if (!_forwarded_signals[i]) {
+			continue;
+		}
+
+		_forwarded_signals[i] = 0;
+
+		memset(&info, 0, sizeof(info));
+
+		info.ssi_signo = (uint32_t)_handled_signals[i];
+		info.ssi_pid = (uint32_t)_forwarded_sender_pids[i];
+
+		log_debug("Signal %d was delivered to a thread that does not block it",
+		          _handled_signals[i]);
+
+		signal_dispatch(&info);
+	}
+}
+
+static void signal_forward(int signal_number, siginfo_t *info, void *context) {
+	int saved_errno = errno;
+	int i;
+
+	(void)context;
+
+	// need to forward signal here with async-safe functions only
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		if (_handled_signals[i] == signal_number) {
+			_forwarded_sender_pids[i] = info->si_pid;
+			_forwarded_signals[i] = 1;
+
+			break;
+		}
+	}
+
+	notifier_signal(&_forward_notifier);
+
+	errno = saved_errno;
+}
+
+// sets errno on error
+static int signal_install_forward_handlers(void) {
+	struct sigaction action;
+	int i;
+
+	memset(&action, 0, sizeof(action));
+
+	action.sa_sigaction = signal_forward;
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+
+	// a forwarding signal handler cannot be interrupted by another one
+	sigemptyset(&action.sa_mask);
+
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		sigaddset(&action.sa_mask, _handled_signals[i]);
+	}
+
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		_forward_handlers_installed[i] = false;
+		_forwarded_signals[i] = 0;
+
+		if (sigaction(_handled_signals[i], NULL, &_previous_actions[i]) < 0) {
+			goto error;
+		}
+
+		if ((_previous_actions[i].sa_flags & SA_SIGINFO) == 0 &&
+		    _previous_actions[i].sa_handler == SIG_IGN) {
+			continue;
+		}
+
+		if (sigaction(_handled_signals[i], &action, NULL) < 0) {
+			goto error;
+		}
+
+		_forward_handlers_installed[i] = true;
+	}
+
+	return 0;
+
+error:
+	log_error("Could not install signal handler for signal %d: %s (%d)",
+	          _handled_signals[i], get_errno_name(errno), errno);
+
+	for (--i; i >= 0; --i) {
+		if (_forward_handlers_installed[i]) {
+			sigaction(_handled_signals[i], &_previous_actions[i], NULL);
+
+			_forward_handlers_installed[i] = false;
+		}
+	}
+
+	return -1;
+}
+
+static void signal_uninstall_forward_handlers(void) {
+	int i;
+
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		if (_forward_handlers_installed[i]) {
+			sigaction(_handled_signals[i], &_previous_actions[i], NULL);
+
+			_forward_handlers_installed[i] = false;
+		}
+	}
+}
+
+// the child is a copy of the forking thread, it sees the values of the thread
+// local variables that this thread set before the fork
+static void signal_save_mask_before_fork(void) {
+	_forking_with_signals_blocked = _signals_blocked;
+
+	if (_forking_with_signals_blocked) {
+		pthread_sigmask(SIG_SETMASK, NULL, &_forking_signal_mask);
+	}
+}
+
+static void signal_restore_mask_in_child(void) {
+	sigset_t signal_mask;
+	int i;
+
+	if (!_forking_with_signals_blocked) {
+		return;
+	}
+
+	signal_mask = _forking_signal_mask;
+
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		if (sigismember(&_previous_signal_mask, _handled_signals[i])) {
+			sigaddset(&signal_mask, _handled_signals[i]);
+		} else {
+			sigdelset(&signal_mask, _handled_signals[i]);
+		}
+
+		if (_forward_handlers_installed[i]) {
+			sigaction(_handled_signals[i], &_previous_actions[i], NULL);
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &signal_mask, NULL);
+}
+
+int signal_init(SIGHUPFunction sighup, SIGUSR1Function sigusr1) {
+	int phase = 0;
+	sigset_t signal_mask;
+	int rc;
+	int i;
+
+	_handle_sighup = sighup;
+	_handle_sigusr1 = sigusr1;
+
+	// fork handlers cannot be uninstalled, install it only once
+	if (!_fork_handler_installed) {
+		rc = pthread_atfork(signal_save_mask_before_fork, NULL, signal_restore_mask_in_child);
+
+		if (rc != 0) {
+			errno = rc;
+
+			log_error("Could not install fork handler: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+
+		_fork_handler_installed = true;
+	}
+
+	// block SIGINT and SIGTERM to stop the event loop and SIGHUP and SIGUSR1
+	// to call a user provided function
+	sigemptyset(&signal_mask);
+
+	for (i = 0; i < HANDLED_SIGNAL_COUNT; ++i) {
+		sigaddset(&signal_mask, _handled_signals[i]);
+	}
+
+	rc = pthread_sigmask(SIG_BLOCK, &signal_mask, &_previous_signal_mask);
+
+	if (rc != 0) {
+		errno = rc;
+
+		log_error("Could not block signals: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	_signals_blocked = true;
+
+	phase = 1;
+
+	// create signalfd
+	_signalfd = signalfd(-1, &signal_mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+	if (_signalfd < 0) {
+		log_error("Could not create signalfd: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 2;
+
+	if (event_add_source(_signalfd, EVENT_SOURCE_TYPE_GENERIC,
+	                     "signal", EVENT_READ, signal_handle, NULL) < 0) {
+		goto cleanup;
+	}
+
+	event_set_source_priority(_signalfd, EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
+	phase = 3;
+
+	// create signal forward notifier
+	if (notifier_create(&_forward_notifier) < 0) {
+		log_error("Could not create signal forward notifier: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 4;
+
+	if (event_add_source(notifier_get_handle(&_forward_notifier), EVENT_SOURCE_TYPE_GENERIC,
+	                     "signal-forward", EVENT_READ, signal_handle_forwarded, NULL) < 0) {
+		goto cleanup;
+	}
+
+	event_set_source_priority(notifier_get_handle(&_forward_notifier),
+	                          EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
+	phase = 5;
+
+	// handle signals delivered to threads that do not block them
+	if (signal_install_forward_handlers() < 0) {
+		goto cleanup;
+	}
+
+	phase = 6;
+
+	// ignore SIGPIPE to make socket functions report EPIPE in case of broken pipes
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		log_error("Could not ignore SIGPIPE signal: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 7;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 6:
+		signal_uninstall_forward_handlers();
+		// fall through
+
+	case 5:
+		event_remove_source(notifier_get_handle(&_forward_notifier), EVENT_SOURCE_TYPE_GENERIC);
+		// fall through
+
+	case 4:
+		notifier_destroy(&_forward_notifier);
+		// fall through
+
+	case 3:
+		event_remove_source(_signalfd, EVENT_SOURCE_TYPE_GENERIC);
+		// fall through
+
+	case 2:
+		robust_close(_signalfd);
+		// fall through
+
+	case 1:
+		pthread_sigmask(SIG_SETMASK, &_previous_signal_mask, NULL);
+
+		_signals_blocked = false;
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 7 ? 0 : -1;
+}
+
+void signal_exit(void) {
+	signal(SIGPIPE, SIG_DFL);
+
+	signal_uninstall_forward_handlers();
+
+	event_remove_source(notifier_get_handle(&_forward_notifier), EVENT_SOURCE_TYPE_GENERIC);
+	notifier_destroy(&_forward_notifier);
+
+	event_remove_source(_signalfd, EVENT_SOURCE_TYPE_GENERIC);
+	robust_close(_signalfd);
+
+	pthread_sigmask(SIG_SETMASK, &_previous_signal_mask, NULL);
+
+	_signals_blocked = false;
+}
@@ -0,0 +1,269 @@
+/*
+ * daemonlib
+ * Copyright (C) 2014, 2017-2019, 2021 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * signal_posix.c: Signal handler based signal handling
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+
+#include "signal.h"
+
+#include "event.h"
+#include "log.h"
+#include "notifier.h"
+#include "utils.h"
+
+static LogSource _log_source = LOG_SOURCE_INITIALIZER;
+
+static Notifier _signal_notifier;
+static volatile sig_atomic_t _sigint_received;
+static volatile sig_atomic_t _sigterm_received;
+static volatile sig_atomic_t _sighup_received;
+static volatile sig_atomic_t _sigusr1_received;
+static SIGHUPFunction _handle_sighup;
+static SIGUSR1Function _handle_sigusr1;
+static bool _fork_handler_installed = false;
+
+static void signal_handle(void *opaque) {
+	(void)opaque;
+
+	// reset the notifier before checking the flags. a signal that arrives
+	// after a flag was checked then signals the notifier again
+	if (notifier_reset(&_signal_notifier) < 0) {
+		log_error("Could not reset signal notifier: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return;
+	}
+
+	if (_sigint_received) {
+		_sigint_received = 0;
+
+		log_info("Received SIGINT");
+
+		event_stop();
+	}
+
+	if (_sigterm_received) {
+		_sigterm_received = 0;
+
+		log_info("Received SIGTERM");
+
+		event_stop();
+	}
+
+	if (_sighup_received) {
+		_sighup_received = 0;
+
+		log_info("Received SIGHUP");
+
+		if (_handle_sighup != NULL) {
+			_handle_sighup();
+		}
+	}
+
+	if (_sigusr1_received) {
+		_sigusr1_received = 0;
+
+		log_info("Received SIGUSR1");
+
+		if (_handle_sigusr1 != NULL) {
+			_handle_sigusr1();
+		}
+	}
+}
+
+static void signal_forward(int signal_number) {
+	int saved_errno = errno;
+
+	// need to forward signal here with async-safe functions only
+	if (signal_number == SIGINT) {
+		_sigint_received = 1;
+	} else if (signal_number == SIGTERM) {
+		_sigterm_received = 1;
+	} else if (signal_number == SIGHUP) {
+		_sighup_received = 1;
+	} else if (signal_number == SIGUSR1) {
+		_sigusr1_received = 1;
+	}
+
+	notifier_signal(&_signal_notifier);
+
+	errno = saved_errno;
+}
+
+// a child process inherits the signal mask of the thread that forked it and
+// keeps it across exec. thread_create blocks the handled signals in the
+// threads it creates. unblock them in the child, otherwise an executed program
+// would start with these signals blocked
+static void signal_unblock_in_child(void) {
+	sigset_t signal_mask;
+
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	sigaddset(&signal_mask, SIGHUP);
+	sigaddset(&signal_mask, SIGUSR1);
+
+	pthread_sigmask(SIG_UNBLOCK, &signal_mask, NULL);
+}
+
+int signal_init(SIGHUPFunction sighup, SIGUSR1Function sigusr1) {
+	int phase = 0;
+	int rc;
+
+	_handle_sighup = sighup;
+	_handle_sigusr1 = sigusr1;
+
+	// fork handlers cannot be uninstalled, install it only once
+	if (!_fork_handler_installed) {
+		rc = pthread_atfork(NULL, NULL, signal_unblock_in_child);
+
+		if (rc != 0) {
+			errno = rc;
+
+			log_error("Could not install fork handler: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			goto cleanup;
+		}
+
+		_fork_handler_installed = true;
+	}
+
+	_sigint_received = 0;
+	_sigterm_received = 0;
+	_sighup_received = 0;
+	_sigusr1_received = 0;
+
+	// create signal notifier
+	if (notifier_create(&_signal_notifier) < 0) {
+		log_error("Could not create signal notifier: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 1;
+
+	if (event_add_source(notifier_get_handle(&_signal_notifier), EVENT_SOURCE_TYPE_GENERIC,
+	                     "signal", EVENT_READ, signal_handle, NULL) < 0) {
+		goto cleanup;
+	}
+
+	event_set_source_priority(notifier_get_handle(&_signal_notifier),
+	                          EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
+	phase = 2;
+
+	// handle SIGINT to stop the event loop
+	if (signal(SIGINT, signal_forward) == SIG_ERR) {
+		log_error("Could not install signal handler for SIGINT: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 3;
+
+	// handle SIGTERM to stop the event loop
+	if (signal(SIGTERM, signal_forward) == SIG_ERR) {
+		log_error("Could not install signal handler for SIGTERM: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 4;
+
+	// ignore SIGPIPE to make socket functions report EPIPE in case of broken pipes
+	if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+		log_error("Could not ignore SIGPIPE signal: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 5;
+
+	// handle SIGHUP to call a user provided function
+	if (signal(SIGHUP, signal_forward) == SIG_ERR) {
+		log_error("Could not install signal handler for SIGHUP: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 6;
+
+	// handle SIGUSR1 to call a user provided function
+	if (signal(SIGUSR1, signal_forward) == SIG_ERR) {
+		log_error("Could not install signal handler for SIGUSR1: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		goto cleanup;
+	}
+
+	phase = 7;
+
+cleanup:
+	switch (phase) { // no breaks, all cases fall through intentionally
+	case 6:
+		signal(SIGHUP, SIG_DFL);
+		// fall through
+
+	case 5:
+		signal(SIGPIPE, SIG_DFL);
+		// fall through
+
+	case 4:
+		signal(SIGTERM, SIG_DFL);
+		// fall through
+
+	case 3:
+		signal(SIGINT, SIG_DFL);
+		// fall through
+
+	case 2:
+		event_remove_source(notifier_get_handle(&_signal_notifier), EVENT_SOURCE_TYPE_GENERIC);
+		// fall through
+
+	case 1:
+		notifier_destroy(&_signal_notifier);
+		// fall through
+
+	default:
+		break;
+	}
+
+	return phase == 7 ? 0 : -1;
+}
+
+void signal_exit(void) {
+	signal(SIGUSR1, SIG_DFL);
+	signal(SIGHUP, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	signal(SIGTERM, SIG_DFL);
+	signal(SIGINT, SIG_DFL);
+
+	event_remove_source(notifier_get_handle(&_signal_notifier), EVENT_SOURCE_TYPE_GENERIC);
+	notifier_destroy(&_signal_notifier);
+}
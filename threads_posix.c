@@ -19,6 +19,7 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <signal.h>
 #include <stdlib.h>
 #include <stdio.h>
 
@@ -130,13 +131,35 @@ static void *thread_wrapper(void *opaque) {
 	return NULL;
 }
 
+// the created thread blocks the signals handled by signal.c. this makes sure
+// that these signals are handled by the main thread and allows signal.c to
+// receive them through a signalfd, which requires them to be blocked in all
+// threads. other signals such as SIGSEGV stay unblocked
 void thread_create(Thread *thread, ThreadFunction function, void *opaque) {
+	sigset_t signal_mask;
+	sigset_t previous_signal_mask;
+
 	thread->function = function;
 	thread->opaque = opaque;
 
+	// the created thread inherits the signal mask of the calling thread
+	sigemptyset(&signal_mask);
+	sigaddset(&signal_mask, SIGINT);
+	sigaddset(&signal_mask, SIGTERM);
+	sigaddset(&signal_mask, SIGHUP);
+	sigaddset(&signal_mask, SIGUSR1);
+
+	if (pthread_sigmask(SIG_BLOCK, &signal_mask, &previous_signal_mask) != 0) {
+		abort();
+	}
+
 	if (pthread_create(&thread->handle, NULL, thread_wrapper, thread) != 0) {
 		abort();
 	}
+
+	if (pthread_sigmask(SIG_SETMASK, &previous_signal_mask, NULL) != 0) {
+		abort();
+	}
 }
 
 void thread_destroy(Thread *thread) {
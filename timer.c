@@ -19,6 +19,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include "timer.h"
+
 #ifdef DAEMONLIB_UWP_BUILD
 	#include "timer_uwp.c"
 #elif defined _WIN32
@@ -28,3 +30,22 @@
 #else
 	#include "timer_posix.c"
 #endif
+
+int timer_create_with_overruns(Timer *timer, TimerOverrunFunction function, void *opaque) {
+	if (timer_create_(timer, NULL, opaque) < 0) {
+		return -1;
+	}
+
+	timer->overrun_function = function;
+
+	return 0;
+}
+
+// setting delay and interval to 0 stops the timer
+int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // microseconds
+	return timer_configure_with_slack(timer, delay, interval, 0);
+}
+
+void timer_get_stats(Timer *timer, TimerStats *stats) {
+	*stats = timer->stats;
+}
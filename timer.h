@@ -37,6 +37,22 @@
 int timer_create_(Timer *timer, TimerFunction function, void *opaque);
 void timer_destroy(Timer *timer);
 
+// the function of such a timer gets the number of expirations that were
+// missed since the last call. they were not handled individually, because the
+// event loop could not keep up with the interval of the timer
+int timer_create_with_overruns(Timer *timer, TimerOverrunFunction function, void *opaque);
+
 int timer_configure(Timer *timer, uint64_t delay, uint64_t interval); // microseconds
+int timer_configure_with_slack(Timer *timer, uint64_t delay, uint64_t interval,
+                               uint64_t slack); // microseconds
+
+// the timer expires on all multiples of the interval on the wall clock,
+// shifted by the epoch, which is given as microseconds since the Unix epoch.
+// all timer backends use the wall clock for this, timers with the same
+// interval and epoch expire in phase and can be handled in the same event loop
+// iteration, even across processes
+int timer_configure_aligned(Timer *timer, uint64_t interval, uint64_t epoch); // microseconds
+
+void timer_get_stats(Timer *timer, TimerStats *stats);
 
 #endif // DAEMONLIB_TIMER_H
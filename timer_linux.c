@@ -20,7 +20,10 @@
  */
 
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "timer_linux.h"
@@ -31,26 +34,181 @@
 
 static LogSource _log_source = LOG_SOURCE_INITIALIZER;
 
+// added in Linux 3.0, but missing from older glibc headers
+#ifndef TFD_TIMER_CANCEL_ON_SET
+	#define TFD_TIMER_CANCEL_ON_SET (1 << 1)
+#endif
+
+// the timerfd uses CLOCK_MONOTONIC or CLOCK_REALTIME, while microtime might
+// use a different clock
+static uint64_t timer_get_time(Timer *timer) { // microseconds
+	struct timespec ts;
+
+	if (clock_gettime(timer->clock, &ts) < 0) {
+		abort(); // clock_gettime cannot fail under normal circumstances
+	}
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// arm the timerfd for the next expiration. with slack each expiration is
+// aligned individually, otherwise the timerfd repeats on its own. a timerfd on
+// CLOCK_REALTIME is canceled if the system clock is set, see timer_handle_read
+static int timer_arm(Timer *timer) {
+	struct itimerspec itimerspec;
+	uint64_t expiry = 0;
+	uint64_t interval = 0;
+	int flags = 0;
+
+	if (timer->next_expiry > 0) {
+		expiry = apply_time_slack(timer->next_expiry, timer->slack);
+		flags = TFD_TIMER_ABSTIME;
+
+		if (timer->clock == CLOCK_REALTIME) {
+			flags |= TFD_TIMER_CANCEL_ON_SET;
+		}
+
+		if (timer->slack == 0) {
+			interval = timer->interval;
+		}
+	}
+
+	itimerspec.it_value.tv_sec = expiry / 1000000;
+	itimerspec.it_value.tv_nsec = (expiry % 1000000) * 1000;
+	itimerspec.it_interval.tv_sec = interval / 1000000;
+	itimerspec.it_interval.tv_nsec = (interval % 1000000) * 1000;
+
+	if (timerfd_settime(timer->handle, flags, &itimerspec, NULL) < 0) {
+		log_error("Could not configure timerfd (handle: %d): %s (%d)",
+		          timer->handle, get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	return 0;
+}
+
 static void timer_handle_read(void *opaque) {
 	Timer *timer = opaque;
-	uint64_t value;
+	uint64_t expirations;
+	uint64_t scheduled;
+	uint64_t now;
+	uint64_t lateness;
 
-	// read the timer expire count and ignore it. the timer function will only
-	// be called once per read operation, even if the timer expired more than
-	// once since the last read operation
-	if (robust_read(timer->handle, &value, sizeof(value)) < 0) {
+	// read the timer expiration count. the timer function is only called
+	// once per read operation, even if the timer expired more than once since
+	// the last read operation. the missed expirations are reported to the
+	// overrun function instead
+	if (robust_read(timer->handle, &expirations, sizeof(expirations)) < 0) {
 		if (errno_would_block()) {
 			return;
 		}
 
+		// the system clock was set. the expirations that the kernel would
+		// report for a step forward did not really happen, and a step backward
+		// would delay the next expiration. align the timer to the new time
+		// again instead, without calling the timer function
+		if (errno == ECANCELED && timer->clock == CLOCK_REALTIME && timer->next_expiry > 0) {
+			log_debug("System clock was set, realigning timerfd (handle: %d)",
+			          timer->handle);
+
+			timer->next_expiry = get_aligned_time(timer_get_time(timer),
+			                                      timer->interval, timer->epoch);
+
+			// timer_arm logs the error. the timer is stopped then, as if
+			// timer_configure_aligned failed
+			if (timer_arm(timer) < 0) {
+				timer->next_expiry = 0;
+			}
+
+			return;
+		}
+
 		log_error("Could not read from timerfd (handle: %d): %s (%d)",
 		          timer->handle, get_errno_name(errno), errno);
 
 		return;
 	}
 
+	now = timer_get_time(timer);
+
+	// a repeated timer with slack is armed for one expiration at a time. the
+	// expiration count is always 1 then, calculate it from the schedule
+	if (timer->slack > 0 && timer->interval > 0 && now > timer->next_expiry) {
+		expirations = (now - timer->next_expiry) / timer->interval + 1;
+	}
+
+	scheduled = timer->next_expiry + (expirations - 1) * timer->interval;
+
+	if (timer->interval > 0) {
+		timer->next_expiry += expirations * timer->interval;
+
+		// timer_arm logs the error. the timer is stopped then, as if
+		// timer_configure_with_slack failed
+		if (timer->slack > 0 && timer_arm(timer) < 0) {
+			timer->next_expiry = 0;
+		}
+	} else {
+		timer->next_expiry = 0;
+	}
+
+	lateness = now > scheduled ? now - scheduled : 0;
+
+	++timer->stats.handled;
+	timer->stats.missed += expirations - 1;
+	timer->stats.total_lateness += lateness;
+
+	if (lateness > timer->stats.max_lateness) {
+		timer->stats.max_lateness = lateness;
+	}
+
 	// this call might reconfigure or destroy the timer
-	timer->function(timer->opaque);
+	if (timer->overrun_function != NULL) {
+		timer->overrun_function(timer->opaque, expirations - 1);
+	} else {
+		timer->function(timer->opaque);
+	}
+}
+
+// the clock of a timerfd cannot be changed, replace the timerfd instead. this
+// drops pending expirations of the old timerfd, the timer is about to be
+// reconfigured anyway
+static int timer_set_clock(Timer *timer, clockid_t clock) {
+	int handle;
+
+	if (timer->clock == clock) {
+		return 0;
+	}
+
+	handle = timerfd_create(clock, TFD_NONBLOCK | TFD_CLOEXEC);
+
+	if (handle < 0) {
+		log_error("Could not create timerfd: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		return -1;
+	}
+
+	if (event_add_source(handle, EVENT_SOURCE_TYPE_GENERIC, "timer",
+	                     EVENT_READ, timer_handle_read, timer) < 0) {
+		robust_close(handle);
+
+		return -1;
+	}
+
+	event_set_source_priority(handle, EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
+	log_debug("Replacing timerfd (handle: %d) with timerfd (handle: %d)",
+	          timer->handle, handle);
+
+	event_remove_source(timer->handle, EVENT_SOURCE_TYPE_GENERIC);
+
+	robust_close(timer->handle);
+
+	timer->handle = handle;
+	timer->clock = clock;
+
+	return 0;
 }
 
 int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
@@ -63,9 +221,17 @@ int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
 		return -1;
 	}
 
+	timer->clock = CLOCK_MONOTONIC;
+	timer->next_expiry = 0;
+	timer->interval = 0;
+	timer->slack = 0;
+	timer->epoch = 0;
 	timer->function = function;
+	timer->overrun_function = NULL;
 	timer->opaque = opaque;
 
+	memset(&timer->stats, 0, sizeof(timer->stats));
+
 	if (event_add_source(timer->handle, EVENT_SOURCE_TYPE_GENERIC, "timer",
 	                     EVENT_READ, timer_handle_read, timer) < 0) {
 		robust_close(timer->handle);
@@ -73,6 +239,8 @@ int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
 		return -1;
 	}
 
+	event_set_source_priority(timer->handle, EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
 	log_debug("Created timerfd (handle: %d)", timer->handle);
 
 	return 0;
@@ -86,25 +254,68 @@ void timer_destroy(Timer *timer) {
 	robust_close(timer->handle);
 }
 
-// setting delay and interval to 0 stops the timer
-int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // microseconds
-	struct itimerspec itimerspec;
+// setting delay and interval to 0 stops the timer. the timer might expire up
+// to slack microseconds late, this allows to merge its expirations with the
+// expirations of other timers into fewer wakeups
+int timer_configure_with_slack(Timer *timer, uint64_t delay, uint64_t interval,
+                               uint64_t slack) { // microseconds
+	// stop the timer first, in case the clock cannot be changed back
+	if (timer->clock != CLOCK_MONOTONIC) {
+		timer->next_expiry = 0;
 
-	itimerspec.it_value.tv_sec = delay / 1000000;
-	itimerspec.it_value.tv_nsec = (delay % 1000000) * 1000;
-	itimerspec.it_interval.tv_sec = interval / 1000000;
-	itimerspec.it_interval.tv_nsec = (interval % 1000000) * 1000;
+		if (timer_arm(timer) < 0 || timer_set_clock(timer, CLOCK_MONOTONIC) < 0) {
+			return -1;
+		}
+	}
+
+	timer->next_expiry = 0;
+	timer->interval = interval;
+	timer->slack = slack;
 
-	// timerfd_settime stops the timer if it_value is zero, independent of
-	// it_interval. this doesn't allow for a repeated timer without initial
-	// delay. detect this case and make it_value non-zero to workaround this
-	if (delay == 0 && interval > 0) {
-		itimerspec.it_value.tv_nsec = 1;
+	// the timerfd is armed with an absolute expiration time. this makes the
+	// schedule of the timer known exactly, which is required to calculate its
+	// lateness. an absolute expiration time is never zero, therefore this also
+	// allows for a repeated timer without initial delay, that would otherwise
+	// be stopped by a zero it_value
+	if (delay > 0 || interval > 0) {
+		timer->next_expiry = timer_get_time(timer) + delay;
 	}
 
-	if (timerfd_settime(timer->handle, 0, &itimerspec, NULL) < 0) {
-		log_error("Could not configure timerfd (handle: %d): %s (%d)",
-		          timer->handle, get_errno_name(errno), errno);
+	if (timer_arm(timer) < 0) {
+		timer->next_expiry = 0;
+
+		return -1;
+	}
+
+	return 0;
+}
+
+// the timerfd is switched to CLOCK_REALTIME and repeats on absolute
+// expiration times. timers with the same interval and epoch stay in phase
+// across processes and timer backends. if the system clock is set then the
+// timer is aligned to the new time again
+int timer_configure_aligned(Timer *timer, uint64_t interval, uint64_t epoch) { // microseconds
+	if (interval == 0) {
+		log_error("Cannot align timerfd (handle: %d) to an interval of 0",
+		          timer->handle);
+
+		return -1;
+	}
+
+	// stop the timer first, in case the clock cannot be changed
+	timer->next_expiry = 0;
+
+	if (timer_arm(timer) < 0 || timer_set_clock(timer, CLOCK_REALTIME) < 0) {
+		return -1;
+	}
+
+	timer->next_expiry = get_aligned_time(timer_get_time(timer), interval, epoch);
+	timer->interval = interval;
+	timer->slack = 0;
+	timer->epoch = epoch;
+
+	if (timer_arm(timer) < 0) {
+		timer->next_expiry = 0;
 
 		return -1;
 	}
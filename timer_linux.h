@@ -22,14 +22,34 @@
 #ifndef DAEMONLIB_TIMER_LINUX_H
 #define DAEMONLIB_TIMER_LINUX_H
 
+#include <stdint.h>
+#include <time.h>
+
 #include "io.h"
 
 typedef void (*TimerFunction)(void *opaque);
+typedef void (*TimerOverrunFunction)(void *opaque, uint64_t missed);
+
+// the lateness is the time between the scheduled expiration and the handling
+// of the latest expiration, accumulated over all handlings of the timer
+typedef struct {
+	uint64_t handled; // number of times the timer function was called
+	uint64_t missed; // expirations that were not handled individually
+	uint64_t total_lateness; // in microseconds
+	uint64_t max_lateness; // in microseconds
+} TimerStats;
 
 typedef struct {
 	IOHandle handle;
+	clockid_t clock; // CLOCK_REALTIME for aligned timers, CLOCK_MONOTONIC otherwise
+	uint64_t next_expiry; // on the clock of the timerfd in microseconds, 0 if not armed
+	uint64_t interval; // in microseconds
+	uint64_t slack; // in microseconds
+	uint64_t epoch; // in microseconds, only used for aligned timers
 	TimerFunction function;
+	TimerOverrunFunction overrun_function;
 	void *opaque;
+	TimerStats stats;
 } Timer;
 
 #endif // DAEMONLIB_TIMER_LINUX_H
@@ -22,221 +22,562 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "timer_posix.h"
 
 #include "event.h"
+#include "heap.h"
 #include "log.h"
+#include "macros.h"
+#include "notifier.h"
+#include "threads.h"
 #include "utils.h"
 
 static LogSource _log_source = LOG_SOURCE_INITIALIZER;
 
-static void timer_handle_read(void *opaque) {
-	Timer *timer = opaque;
-	uint32_t configuration_id;
+// the notification channel of an event loop. the expired list is protected by
+// the timer mutex
+struct _TimerChannel {
+	TimerChannel *next;
+	EventLoop *event_loop;
+	Notifier notifier;
+	int timer_count;
+	Timer *expired_head;
+	bool dispatching; // only accessed by the thread running the event loop
+	bool orphaned; // free after dispatching, only accessed by that thread too
+};
+
+// timers can be created and destroyed from multiple threads, each running its
+// own event loop. the timer mutex protects everything the timer thread
+// accesses. the thread mutex serializes starting and stopping the timer
+// thread, it is never locked by the timer thread itself. both are static,
+// because there is no function that could create them before the first timer
+static Mutex _mutex = { PTHREAD_MUTEX_INITIALIZER };
+static Mutex _thread_mutex = { PTHREAD_MUTEX_INITIALIZER };
+static Thread _thread;
+static bool _running = false;
+static Notifier _interrupt_notifier;
+static int _timer_count = 0;
+static Heap _heap; // Timer heap nodes, ordered by wakeup
+static TimerChannel *_channels = NULL;
+
+static Timer *timer_get_first(void) {
+	HeapNode *node = heap_peek(&_heap);
+
+	return node != NULL ? containerof(node, Timer, heap_node) : NULL;
+}
 
-	if (pipe_read(&timer->notification_pipe, &configuration_id,
-	              sizeof(configuration_id)) < 0) {
-		log_error("Could not read from notification pipe of poll timer (handle: %d): %s (%d)",
-		          timer->notification_pipe.base.read_handle,
-		          get_errno_name(errno), errno);
+static void timer_unlink_expired(Timer *timer) {
+	*timer->expired_previous_next = timer->expired_next;
 
-		return;
+	if (timer->expired_next != NULL) {
+		timer->expired_next->expired_previous_next = timer->expired_previous_next;
 	}
 
-	if (configuration_id != timer->configuration_id) {
-		log_debug("Ignoring timer event for mismatching configuration of poll timer (handle: %d)",
-		          timer->notification_pipe.base.read_handle);
+	timer->expired_next = NULL;
+	timer->expired_previous_next = NULL;
+}
 
-		return;
+// called by the timer thread with the timer mutex locked
+static void timer_expire(Timer *timer, uint64_t now) {
+	TimerChannel *channel = timer->channel;
+	bool was_empty = channel->expired_head == NULL;
+
+	timer->expired_configuration_id = timer->configuration_id;
+
+	if (timer->expired_previous_next == NULL) {
+		timer->expired_next = channel->expired_head;
+		timer->expired_previous_next = &channel->expired_head;
+
+		if (channel->expired_head != NULL) {
+			channel->expired_head->expired_previous_next = &timer->expired_next;
+		}
+
+		channel->expired_head = timer;
 	}
 
-	// this call might reconfigure or destroy the timer
-	timer->function(timer->opaque);
+	// skip expirations that already passed, the event loop calculates their
+	// number on its own
+	if (timer->interval > 0) {
+		timer->deadline += ((now - timer->deadline) / timer->interval + 1) * timer->interval;
+
+		heap_update(&_heap, &timer->heap_node, apply_time_slack(timer->deadline, timer->slack));
+	} else {
+		heap_remove(&_heap, &timer->heap_node);
+	}
+
+	// the channel only has to be signaled once until its expired list gets
+	// drained by the event loop
+	if (was_empty && notifier_signal(&channel->notifier) < 0) {
+		log_error("Could not signal notifier of timer channel (handle: %d): %s (%d)",
+		          notifier_get_handle(&channel->notifier), get_errno_name(errno), errno);
+	}
 }
 
 static void timer_thread(void *opaque) {
-	Timer *timer = opaque;
-	bool delay_done = true;
-	uint64_t delay = 0;
-	uint64_t interval = 0;
-	uint32_t configuration_id = timer->configuration_id;
 	struct pollfd pollfd;
+	uint64_t now;
+	Timer *timer;
 	int timeout;
 	int ready;
-	uint8_t byte;
 
-	pollfd.fd = timer->interrupt_pipe.base.read_handle;
+	(void)opaque;
+
+	pollfd.fd = notifier_get_handle(&_interrupt_notifier);
 	pollfd.events = POLLIN;
 
-	while (timer->running) {
-		if (delay == 0 && interval == 0) {
-			timeout = -1;
-		} else if (!delay_done) {
-			delay_done = true;
-
-			// convert from microseconds to milliseconds
-			if (delay == 0) {
-				timeout = 0;
-			} else if (delay < 1000) {
-				timeout = 1;
-			} else {
-				timeout = (delay + 500) / 1000;
-			}
-		} else {
-			// convert from microseconds to milliseconds
-			if (interval == 0) {
-				timeout = -1;
-			} else if (interval < 1000) {
-				timeout = 1;
-			} else {
-				timeout = (interval + 500) / 1000;
+	mutex_lock(&_mutex);
+
+	while (_running) {
+		now = microtime();
+		timeout = -1;
+
+		while ((timer = timer_get_first()) != NULL) {
+			// convert from microseconds to milliseconds, round up to
+			// never wake up before the deadline
+			if (timer->heap_node.key > now) {
+				if (timer->heap_node.key - now > INT32_MAX * (uint64_t)1000) {
+					timeout = INT32_MAX;
+				} else {
+					timeout = (int)((timer->heap_node.key - now + 999) / 1000);
+				}
+
+				break;
 			}
+
+			timer_expire(timer, now);
 		}
 
+		mutex_unlock(&_mutex);
+
 		ready = poll(&pollfd, 1, timeout);
 
-		if (ready < 0) {
-			if (errno_interrupted()) {
-				continue;
-			}
+		if (ready < 0 && !errno_interrupted()) {
+			log_error("Could not poll on interrupt notifier of timer thread: %s (%d)",
+			          get_errno_name(errno), errno);
+
+			mutex_lock(&_mutex);
 
-			log_debug("Could not poll on interrupt pipe of poll timer (handle: %d): %s (%d)",
-			          timer->notification_pipe.base.read_handle,
+			break;
+		}
+
+		if (ready > 0 && notifier_reset(&_interrupt_notifier) < 0) {
+			log_error("Could not reset interrupt notifier of timer thread: %s (%d)",
 			          get_errno_name(errno), errno);
 
+			mutex_lock(&_mutex);
+
 			break;
-		} else if (ready == 0) {
-			if (pipe_write(&timer->notification_pipe, &configuration_id,
-			               sizeof(configuration_id)) < 0) {
-				log_error("Could not write to notification pipe of poll timer (handle: %d): %s (%d)",
-				          timer->notification_pipe.base.read_handle,
-				          get_errno_name(errno), errno);
+		}
 
-				break;
-			}
-		} else {
-			if (pipe_read(&timer->interrupt_pipe, &byte, sizeof(byte)) < 0) {
-				log_error("Could not read from interrupt pipe of poll timer (handle: %d): %s (%d)",
-				          timer->notification_pipe.base.read_handle,
-				          get_errno_name(errno), errno);
+		mutex_lock(&_mutex);
+	}
 
-				break;
-			}
+	_running = false;
 
-			if (!timer->running) {
-				break;
-			}
+	mutex_unlock(&_mutex);
+}
+
+// wakes up the timer thread to let it recalculate its timeout
+static void timer_interrupt_thread(void) {
+	if (notifier_signal(&_interrupt_notifier) < 0) {
+		log_error("Could not signal interrupt notifier of timer thread: %s (%d)",
+		          get_errno_name(errno), errno);
+	}
+}
+
+static int timer_apply_schedule(Timer *timer, uint64_t next_expiry, uint64_t interval,
+                                uint64_t slack);
+
+// returns the next multiple of the interval on the wall clock, shifted by the
+// epoch and converted to microtime
+static uint64_t timer_get_aligned_expiry(uint64_t interval, uint64_t epoch) {
+	uint64_t now = microtime();
+	uint64_t realtime = realtime_microtime();
+
+	return now + get_aligned_time(realtime, interval, epoch) - realtime;
+}
+
+// the schedule of the timer might have changed in the meantime. therefore,
+// calculate the number of expirations from the current schedule of the timer
+static void timer_handle_expiry(Timer *timer) {
+	uint64_t now = microtime();
+	uint64_t expirations;
+	uint64_t scheduled;
+	uint64_t lateness;
 
-			delay_done = false;
-			delay = timer->delay;
-			interval = timer->interval;
-			configuration_id = timer->configuration_id;
+	if (timer->next_expiry == 0 || now < timer->next_expiry) {
+		log_debug("Ignoring timer event for already handled expiration of timer (%p)",
+		          (void *)timer);
 
-			semaphore_release(&timer->handshake);
+		return;
+	}
+
+	if (timer->interval > 0) {
+		expirations = (now - timer->next_expiry) / timer->interval + 1;
+		scheduled = timer->next_expiry + (expirations - 1) * timer->interval;
+		timer->next_expiry += expirations * timer->interval;
+
+		// microtime drifts against the wall clock and the system clock might
+		// have been set. align the next expiration to the wall clock again.
+		// timer_apply_schedule logs the error. the timer is stopped then, as
+		// if timer_configure_aligned failed
+		if (timer->aligned &&
+		    timer_apply_schedule(timer, timer_get_aligned_expiry(timer->interval, timer->epoch),
+		                         timer->interval, 0) < 0) {
+			timer->next_expiry = 0;
 		}
+	} else {
+		expirations = 1;
+		scheduled = timer->next_expiry;
+		timer->next_expiry = 0;
 	}
 
-	timer->running = false;
+	lateness = now - scheduled;
+
+	++timer->stats.handled;
+	timer->stats.missed += expirations - 1;
+	timer->stats.total_lateness += lateness;
 
-	semaphore_release(&timer->handshake);
+	if (lateness > timer->stats.max_lateness) {
+		timer->stats.max_lateness = lateness;
+	}
+
+	// this call might reconfigure or destroy the timer
+	if (timer->overrun_function != NULL) {
+		timer->overrun_function(timer->opaque, expirations - 1);
+	} else {
+		timer->function(timer->opaque);
+	}
 }
 
-int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
-	int phase = 0;
+static void timer_free_channel(TimerChannel *channel) {
+	notifier_destroy(&channel->notifier);
+	free(channel);
+}
+
+static void timer_handle_channel(void *opaque) {
+	TimerChannel *channel = opaque;
+	Timer *timer;
+	bool stale;
+
+	if (notifier_reset(&channel->notifier) < 0) {
+		log_error("Could not reset notifier of timer channel (handle: %d): %s (%d)",
+		          notifier_get_handle(&channel->notifier), get_errno_name(errno), errno);
+
+		return;
+	}
+
+	channel->dispatching = true;
+
+	// take one timer at a time from the expired list, because the function of
+	// a timer might destroy any other timer of this channel
+	while (!channel->orphaned) {
+		mutex_lock(&_mutex);
+
+		timer = channel->expired_head;
+
+		if (timer == NULL) {
+			mutex_unlock(&_mutex);
+
+			break;
+		}
+
+		timer_unlink_expired(timer);
+
+		stale = timer->expired_configuration_id != timer->configuration_id;
 
-	// create notification pipe
-	if (pipe_create(&timer->notification_pipe, PIPE_FLAG_NON_BLOCKING_READ) < 0) {
-		log_error("Could not create notification pipe: %s (%d)",
+		mutex_unlock(&_mutex);
+
+		if (stale) {
+			log_debug("Ignoring timer event for previous configuration of timer (%p)",
+			          (void *)timer);
+
+			continue;
+		}
+
+		timer_handle_expiry(timer);
+	}
+
+	channel->dispatching = false;
+
+	// the last timer of this channel got destroyed during the dispatching
+	if (channel->orphaned) {
+		timer_free_channel(channel);
+	}
+}
+
+// called with the timer mutex locked
+static TimerChannel *timer_acquire_channel(void) {
+	EventLoop *event_loop = event_get_current_loop();
+	TimerChannel *channel;
+
+	for (channel = _channels; channel != NULL; channel = channel->next) {
+		if (channel->event_loop == event_loop) {
+			++channel->timer_count;
+
+			return channel;
+		}
+	}
+
+	channel = calloc(1, sizeof(TimerChannel));
+
+	if (channel == NULL) {
+		errno = ENOMEM;
+
+		log_error("Could not allocate timer channel: %s (%d)",
 		          get_errno_name(errno), errno);
 
-		goto cleanup;
+		return NULL;
 	}
 
-	phase = 1;
+	if (notifier_create(&channel->notifier) < 0) {
+		log_error("Could not create notifier of timer channel: %s (%d)",
+		          get_errno_name(errno), errno);
+
+		free(channel);
+
+		return NULL;
+	}
+
+	if (event_loop_add_source(event_loop, notifier_get_handle(&channel->notifier),
+	                          EVENT_SOURCE_TYPE_GENERIC, "timer", EVENT_READ,
+	                          timer_handle_channel, channel) < 0) {
+		timer_free_channel(channel);
+
+		return NULL;
+	}
+
+	event_loop_set_source_priority(event_loop, notifier_get_handle(&channel->notifier),
+	                               EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
+	channel->event_loop = event_loop;
+	channel->timer_count = 1;
+	channel->next = _channels;
+	_channels = channel;
+
+	return channel;
+}
+
+// called with the timer mutex locked
+static void timer_release_channel(TimerChannel *channel) {
+	TimerChannel **previous_next;
+
+	if (--channel->timer_count > 0) {
+		return;
+	}
+
+	for (previous_next = &_channels; *previous_next != channel;
+	     previous_next = &(*previous_next)->next) {
+	}
+
+	*previous_next = channel->next;
+
+	event_loop_remove_source(channel->event_loop, notifier_get_handle(&channel->notifier),
+	                         EVENT_SOURCE_TYPE_GENERIC);
 
-	// create interrupt pipe
-	if (pipe_create(&timer->interrupt_pipe, PIPE_FLAG_NON_BLOCKING_READ) < 0) {
-		log_error("Could not create interrupt pipe: %s (%d)",
+	if (channel->dispatching) {
+		channel->orphaned = true;
+	} else {
+		timer_free_channel(channel);
+	}
+}
+
+// called with the thread mutex locked
+static int timer_start_thread(void) {
+	int phase = 0;
+
+	if (heap_create(&_heap, 32) < 0) {
+		log_error("Could not create timer heap: %s (%d)",
 		          get_errno_name(errno), errno);
 
 		goto cleanup;
 	}
 
-	phase = 2;
+	phase = 1;
 
-	// register notification pipe as event source
-	timer->function = function;
-	timer->opaque = opaque;
+	if (notifier_create(&_interrupt_notifier) < 0) {
+		log_error("Could not create interrupt notifier of timer thread: %s (%d)",
+		          get_errno_name(errno), errno);
 
-	if (event_add_source(timer->notification_pipe.base.read_handle,
-	                     EVENT_SOURCE_TYPE_GENERIC, "timer", EVENT_READ,
-	                     timer_handle_read, timer) < 0) {
 		goto cleanup;
 	}
 
-	phase = 3;
+	phase = 2;
 
-	// create thread
-	timer->running = true;
-	timer->delay = 0;
-	timer->interval = 0;
-	timer->configuration_id = 0;
+	_running = true;
 
-	semaphore_create(&timer->handshake);
-	thread_create(&timer->thread, timer_thread, timer);
+	thread_create(&_thread, timer_thread, NULL);
 
-	log_debug("Created poll timer (handle: %d)",
-	          timer->notification_pipe.base.read_handle);
+	log_debug("Started timer thread");
 
 cleanup:
 	switch (phase) { // no breaks, all cases fall through intentionally
-	case 2:
-		pipe_destroy(&timer->interrupt_pipe);
-		// fall through
-
 	case 1:
-		pipe_destroy(&timer->notification_pipe);
+		heap_destroy(&_heap);
 		// fall through
 
 	default:
 		break;
 	}
 
-	return phase == 3 ? 0 : -1;
+	return phase == 2 ? 0 : -1;
+}
+
+// called with the thread mutex locked
+static void timer_stop_thread(void) {
+	mutex_lock(&_mutex);
+
+	_running = false;
+
+	mutex_unlock(&_mutex);
+
+	timer_interrupt_thread();
+	thread_join(&_thread);
+	thread_destroy(&_thread);
+
+	notifier_destroy(&_interrupt_notifier);
+	heap_destroy(&_heap);
+
+	log_debug("Stopped timer thread");
+}
+
+int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
+	int rc = 0;
+
+	memset(timer, 0, sizeof(Timer));
+
+	heap_init_node(&timer->heap_node);
+
+	timer->function = function;
+	timer->opaque = opaque;
+
+	mutex_lock(&_thread_mutex);
+
+	if (_timer_count == 0 && timer_start_thread() < 0) {
+		mutex_unlock(&_thread_mutex);
+
+		return -1;
+	}
+
+	mutex_lock(&_mutex);
+
+	timer->channel = timer_acquire_channel();
+
+	if (timer->channel == NULL) {
+		rc = -1;
+	} else {
+		++_timer_count;
+	}
+
+	mutex_unlock(&_mutex);
+
+	if (_timer_count == 0) {
+		timer_stop_thread();
+	}
+
+	mutex_unlock(&_thread_mutex);
+
+	if (rc < 0) {
+		return -1;
+	}
+
+	log_debug("Created timer (%p)", (void *)timer);
+
+	return 0;
 }
 
 void timer_destroy(Timer *timer) {
-	uint8_t byte = 0;
+	log_debug("Destroying timer (%p)", (void *)timer);
+
+	mutex_lock(&_thread_mutex);
+	mutex_lock(&_mutex);
+
+	if (timer->heap_node.index >= 0) {
+		heap_remove(&_heap, &timer->heap_node);
+	}
+
+	if (timer->expired_previous_next != NULL) {
+		timer_unlink_expired(timer);
+	}
+
+	timer_release_channel(timer->channel);
+
+	--_timer_count;
+
+	mutex_unlock(&_mutex);
+
+	if (_timer_count == 0) {
+		timer_stop_thread();
+	}
+
+	mutex_unlock(&_thread_mutex);
+}
+
+// hand the new schedule over to the timer thread. the thread is only woken
+// up if the earliest wakeup changed
+static int timer_apply_schedule(Timer *timer, uint64_t next_expiry, uint64_t interval,
+                                uint64_t slack) {
+	bool was_first;
+	bool is_first = false;
+	int rc = 0;
+
+	mutex_lock(&_mutex);
+
+	if (!_running) {
+		mutex_unlock(&_mutex);
 
-	log_debug("Destroying poll timer (handle: %d)",
-	          timer->notification_pipe.base.read_handle);
+		log_error("Timer thread exited due to an error, cannot configure timer (%p)",
+		          (void *)timer);
 
-	if (timer->running) {
-		timer->running = false;
+		return -1;
+	}
+
+	was_first = timer->heap_node.index == 0;
+
+	// the timer thread might have already put an expiration of the previous
+	// configuration into the expired list. it is ignored because of the new
+	// configuration ID
+	++timer->configuration_id;
+
+	timer->interval = interval;
+	timer->slack = slack;
+	timer->next_expiry = next_expiry;
 
-		if (pipe_write(&timer->interrupt_pipe, &byte, sizeof(byte)) < 0) {
-			log_error("Could not write to interrupt pipe for poll timer (handle: %d): %s (%d)",
-			          timer->notification_pipe.base.read_handle,
+	// an already armed timer keeps its place in the heap and only gets a new
+	// wakeup, this cannot fail
+	if (next_expiry > 0) {
+		timer->deadline = next_expiry;
+
+		if (heap_push(&_heap, &timer->heap_node, apply_time_slack(next_expiry, slack)) < 0) {
+			log_error("Could not append to timer heap: %s (%d)",
 			          get_errno_name(errno), errno);
+
+			timer->next_expiry = 0;
+			rc = -1;
 		} else {
-			thread_join(&timer->thread);
+			is_first = timer->heap_node.index == 0;
 		}
+	} else if (timer->heap_node.index >= 0) {
+		heap_remove(&_heap, &timer->heap_node);
 	}
 
-	event_remove_source(timer->notification_pipe.base.read_handle, EVENT_SOURCE_TYPE_GENERIC);
-
-	semaphore_destroy(&timer->handshake);
+	mutex_unlock(&_mutex);
 
-	pipe_destroy(&timer->interrupt_pipe);
+	if (was_first || is_first) {
+		timer_interrupt_thread();
+	}
 
-	pipe_destroy(&timer->notification_pipe);
+	return rc;
 }
 
-// setting delay and interval to 0 stops the timer
-int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // microseconds
-	uint8_t byte = 0;
-
+// setting delay and interval to 0 stops the timer. the timer might expire up
+// to slack microseconds late, this allows to merge its expirations with the
+// expirations of other timers into fewer wakeups
+int timer_configure_with_slack(Timer *timer, uint64_t delay, uint64_t interval,
+                               uint64_t slack) { // microseconds
 	if (delay > INT32_MAX) {
 		log_error("Delay of %"PRIu64" microseconds is too long", delay);
 
@@ -249,34 +590,32 @@ int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // micros
 		return -1;
 	}
 
-	if (!timer->running) {
-		log_error("Thread for poll timer (handle: %d) is not running",
-		          timer->notification_pipe.base.read_handle);
+	timer->aligned = false;
 
-		return -1;
-	}
-
-	timer->delay = delay;
-	timer->interval = interval;
-
-	++timer->configuration_id;
+	return timer_apply_schedule(timer, delay > 0 || interval > 0 ? microtime() + delay : 0,
+	                            interval, slack);
+}
 
-	if (pipe_write(&timer->interrupt_pipe, &byte, sizeof(byte)) < 0) {
-		log_error("Could not write to interrupt pipe for poll timer (handle: %d): %s (%d)",
-		          timer->notification_pipe.base.read_handle,
-		          get_errno_name(errno), errno);
+// the timer expires on all multiples of the interval on the wall clock,
+// shifted by the epoch. the timer thread uses microtime, therefore each
+// expiration is converted from the wall clock individually. timers with the
+// same interval and epoch stay in phase across processes and timer backends
+int timer_configure_aligned(Timer *timer, uint64_t interval, uint64_t epoch) { // microseconds
+	if (interval == 0) {
+		log_error("Cannot align timer (%p) to an interval of 0", (void *)timer);
 
 		return -1;
 	}
 
-	semaphore_acquire(&timer->handshake);
-
-	if (!timer->running) {
-		log_error("Thread for poll timer (handle: %d) exited due to an error",
-		          timer->notification_pipe.base.read_handle);
+	if (interval > INT32_MAX) {
+		log_error("Interval of %"PRIu64" microseconds is too long", interval);
 
 		return -1;
 	}
 
-	return 0;
+	timer->aligned = true;
+	timer->epoch = epoch;
+
+	return timer_apply_schedule(timer, timer_get_aligned_expiry(interval, epoch),
+	                            interval, 0);
 }
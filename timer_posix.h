@@ -25,23 +25,44 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "heap.h"
 #include "io.h"
-#include "pipe.h"
-#include "threads.h"
 
 typedef void (*TimerFunction)(void *opaque);
+typedef void (*TimerOverrunFunction)(void *opaque, uint64_t missed);
 
+// the lateness is the time between the scheduled expiration and the handling
+// of the latest expiration, accumulated over all handlings of the timer
 typedef struct {
-	Pipe notification_pipe;
-	Pipe interrupt_pipe;
-	Semaphore handshake;
-	Thread thread;
-	bool running;
-	uint64_t delay; // in microseconds
-	uint64_t interval; // in microseconds
+	uint64_t handled; // number of times the timer function was called
+	uint64_t missed; // expirations that were not handled individually
+	uint64_t total_lateness; // in microseconds
+	uint64_t max_lateness; // in microseconds
+} TimerStats;
+
+typedef struct _TimerChannel TimerChannel;
+typedef struct _Timer Timer;
+
+// all timers share a single thread. it notifies the event loop that was
+// current on creation of a timer through a channel shared by all timers of
+// that event loop
+struct _Timer {
+	TimerChannel *channel;
+	HeapNode heap_node; // key is the microtime deadline with slack applied, for internal use by the timer thread
+	uint64_t deadline; // microtime, for internal use by the timer thread
 	uint32_t configuration_id;
+	uint32_t expired_configuration_id; // configuration the expiration belongs to
+	Timer *expired_next; // in expired list of the channel
+	Timer **expired_previous_next; // NULL if not in expired list
+	uint64_t interval; // in microseconds
+	uint64_t slack; // in microseconds
+	uint64_t next_expiry; // microtime, 0 if not armed
+	bool aligned; // expiry follows the wall clock
+	uint64_t epoch; // wall clock in microseconds, only used if aligned
 	TimerFunction function;
+	TimerOverrunFunction overrun_function;
 	void *opaque;
-} Timer;
+	TimerStats stats;
+};
 
 #endif // DAEMONLIB_TIMER_POSIX_H
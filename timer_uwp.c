@@ -20,6 +20,7 @@
  */
 
 #include <errno.h>
+#include <string.h>
 
 #include "timer_uwp.h"
 
@@ -32,6 +33,9 @@ static LogSource _log_source = LOG_SOURCE_INITIALIZER;
 static void timer_handle_read(void *opaque) {
 	Timer *timer = opaque;
 	uint32_t configuration_id;
+	uint64_t now;
+	uint64_t scheduled;
+	uint64_t lateness;
 
 	if (pipe_read(&timer->notification_pipe, &configuration_id,
 	              sizeof(configuration_id)) < 0) {
@@ -48,8 +52,31 @@ static void timer_handle_read(void *opaque) {
 		return;
 	}
 
+	// the thread reports each expiration individually, none are missed.
+	// the lateness is calculated relative to the configuration of the timer
+	now = microtime();
+	scheduled = timer->next_expiry;
+	lateness = now > scheduled ? now - scheduled : 0;
+
+	if (timer->interval > 0) {
+		timer->next_expiry += timer->interval < 1000 ? 1000 : (timer->interval + 500) / 1000 * 1000;
+	} else {
+		timer->next_expiry = 0;
+	}
+
+	++timer->stats.handled;
+	timer->stats.total_lateness += lateness;
+
+	if (lateness > timer->stats.max_lateness) {
+		timer->stats.max_lateness = lateness;
+	}
+
 	// this call might reconfigure or destroy the timer
-	timer->function(timer->opaque);
+	if (timer->overrun_function != NULL) {
+		timer->overrun_function(timer->opaque, 0);
+	} else {
+		timer->function(timer->opaque);
+	}
 }
 
 static void timer_thread(void *opaque) {
@@ -158,14 +185,20 @@ int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
 
 	// register notification pipe as event source
 	timer->function = function;
+	timer->overrun_function = NULL;
 	timer->opaque = opaque;
 
+	memset(&timer->stats, 0, sizeof(timer->stats));
+
 	if (event_add_source(timer->notification_pipe.base.read_handle,
 	                     EVENT_SOURCE_TYPE_GENERIC, "timer", EVENT_READ,
 	                     timer_handle_read, timer) < 0) {
 		goto cleanup;
 	}
 
+	event_set_source_priority(timer->notification_pipe.base.read_handle,
+	                          EVENT_SOURCE_TYPE_GENERIC, EVENT_SOURCE_PRIORITY_HIGH);
+
 	phase = 3;
 
 	// create thread
@@ -173,6 +206,7 @@ int timer_create_(Timer *timer, TimerFunction function, void *opaque) {
 	timer->delay = 0;
 	timer->interval = 0;
 	timer->configuration_id = 0;
+	timer->next_expiry = 0;
 
 	semaphore_create(&timer->handshake);
 	thread_create(&timer->thread, timer_thread, timer);
@@ -223,10 +257,14 @@ void timer_destroy(Timer *timer) {
 	pipe_destroy(&timer->notification_pipe);
 }
 
-// setting delay and interval to 0 stops the timer
-int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // microseconds
+// setting delay and interval to 0 stops the timer. slack is not supported
+// by this backend, the timer always expires as scheduled
+int timer_configure_with_slack(Timer *timer, uint64_t delay, uint64_t interval,
+                               uint64_t slack) { // microseconds
 	int rc;
 
+	(void)slack;
+
 	if (!timer->running) {
 		log_error("Thread for interrupt event (handle: %p) is not running",
 		          timer->interrupt_event);
@@ -236,6 +274,7 @@ int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // micros
 
 	timer->delay = delay;
 	timer->interval = interval;
+	timer->next_expiry = delay > 0 || interval > 0 ? microtime() + delay : 0;
 
 	++timer->configuration_id;
 
@@ -259,3 +298,20 @@ int timer_configure(Timer *timer, uint64_t delay, uint64_t interval) { // micros
 
 	return 0;
 }
+
+// the timer expires on all multiples of the interval on the wall clock,
+// shifted by the epoch. this backend only supports relative timers, the first
+// expiration is aligned but later ones might drift away from the grid
+int timer_configure_aligned(Timer *timer, uint64_t interval, uint64_t epoch) { // microseconds
+	uint64_t now = realtime_microtime();
+
+	if (interval == 0) {
+		log_error("Cannot align interrupt event (handle: %p) to an interval of 0",
+		          timer->interrupt_event);
+
+		return -1;
+	}
+
+	return timer_configure_with_slack(timer, get_aligned_time(now, interval, epoch) - now,
+	                                  interval, 0);
+}
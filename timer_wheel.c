@@ -0,0 +1,375 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * timer_wheel.c: Hierarchical timer wheel for many lightweight timers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * the timer wheel has 4 levels of 64 slots each with a tick length of 1
+ * millisecond. a wheel timer that expires within the next 64 ticks is stored
+ * in level 0 in the slot of its expiry tick. a wheel timer that expires later
+ * is stored in a higher level with a 64 times coarser granularity per level.
+ * whenever the wheel passes a multiple of 64 ticks the next slot of the next
+ * higher level is cascaded, its wheel timers are moved to lower levels. wheel
+ * timers that expire more than 4.6 hours in the future are stored in the last
+ * slot that can be represented and cascade again from there.
+ *
+ * adding and removing a wheel timer is O(1) and does not require a syscall.
+ * the single underlying timer is only reconfigured if a wheel timer expires
+ * earlier than the underlying timer is currently armed for.
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#include "log.h"
+#include "utils.h"
+
+static LogSource _log_source = LOG_SOURCE_INITIALIZER;
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOT_COUNT - 1)
+#define TIMER_WHEEL_MAX_DELTA (((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVEL_COUNT)) - 1)
+
+// returns the distance from start to the next set bit in a 64 bit mask,
+// wrapping around at the end. the mask has to be non-zero
+static int timer_wheel_find_slot(uint64_t occupied, int start) {
+	uint64_t rotated = start == 0 ? occupied : (occupied >> start) | (occupied << (64 - start));
+#ifdef __GNUC__
+	return __builtin_ctzll(rotated);
+#else
+	int distance = 0;
+
+	while ((rotated & 1) == 0) {
+		rotated >>= 1;
+		++distance;
+	}
+
+	return distance;
+#endif
+}
+
+static uint64_t timer_wheel_get_tick(TimerWheel *wheel) {
+	return (microtime() - wheel->base) / TIMER_WHEEL_TICK_LENGTH;
+}
+
+static void timer_wheel_link(WheelTimer **head, WheelTimer *timer) {
+	timer->next = *head;
+	timer->previous_next = head;
+
+	if (*head != NULL) {
+		(*head)->previous_next = &timer->next;
+	}
+
+	*head = timer;
+}
+
+static void timer_wheel_unlink(WheelTimer *timer) {
+	*timer->previous_next = timer->next;
+
+	if (timer->next != NULL) {
+		timer->next->previous_next = timer->previous_next;
+	}
+
+	timer->next = NULL;
+	timer->previous_next = NULL;
+}
+
+static void timer_wheel_insert(TimerWheel *wheel, WheelTimer *timer) {
+	uint64_t expiry = timer->expiry;
+	uint64_t delta;
+	int level;
+
+	// an expiry equal to the current tick is only possible while cascading.
+	// then the current level 0 slot is processed right afterwards
+	if (expiry < wheel->now) {
+		expiry = wheel->now;
+	}
+
+	delta = expiry - wheel->now;
+
+	// wheel timers beyond the range of the wheel are cascaded again once
+	// they reached the last representable slot
+	if (delta > TIMER_WHEEL_MAX_DELTA) {
+		expiry = wheel->now + TIMER_WHEEL_MAX_DELTA;
+		delta = TIMER_WHEEL_MAX_DELTA;
+	}
+
+	for (level = 0; level < TIMER_WHEEL_LEVEL_COUNT - 1; ++level) {
+		if (delta < ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * (level + 1)))) {
+			break;
+		}
+	}
+
+	timer->level = level;
+	timer->slot = (int)(expiry >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+
+	timer_wheel_link(&wheel->slots[level][timer->slot], timer);
+
+	wheel->occupied[level] |= (uint64_t)1 << timer->slot;
+}
+
+static void timer_wheel_remove(TimerWheel *wheel, WheelTimer *timer) {
+	int level = timer->level;
+	int slot = timer->slot;
+
+	timer_wheel_unlink(timer);
+
+	timer->level = -1;
+
+	if (level >= 0 && wheel->slots[level][slot] == NULL) {
+		wheel->occupied[level] &= ~((uint64_t)1 << slot);
+	}
+}
+
+// returns the next tick at which a level 0 slot has to be processed or a
+// higher level slot has to be cascaded, 0 if the wheel is empty
+static uint64_t timer_wheel_get_next_tick(TimerWheel *wheel) {
+	uint64_t next_tick = 0;
+	uint64_t tick;
+	uint64_t position;
+	int level;
+	int shift;
+
+	for (level = 0; level < TIMER_WHEEL_LEVEL_COUNT; ++level) {
+		if (wheel->occupied[level] == 0) {
+			continue;
+		}
+
+		// the current slot of each level was already processed, a wheel
+		// timer in it belongs to the next rotation of that level
+		shift = TIMER_WHEEL_SLOT_BITS * level;
+		position = (wheel->now >> shift) + 1;
+		tick = (position + timer_wheel_find_slot(wheel->occupied[level],
+		                                         (int)(position & TIMER_WHEEL_SLOT_MASK))) << shift;
+
+		if (next_tick == 0 || tick < next_tick) {
+			next_tick = tick;
+		}
+	}
+
+	return next_tick;
+}
+
+static void timer_wheel_arm(TimerWheel *wheel) {
+	uint64_t next_tick = timer_wheel_get_next_tick(wheel);
+	uint64_t expiry;
+	uint64_t current;
+
+	if (next_tick == 0 || next_tick == wheel->armed_tick) {
+		return;
+	}
+
+	expiry = wheel->base + next_tick * TIMER_WHEEL_TICK_LENGTH;
+	current = microtime();
+
+	// a delay of 0 would stop the underlying timer
+	if (timer_configure(&wheel->timer, expiry > current ? expiry - current : 1, 0) < 0) {
+		wheel->armed_tick = 0;
+
+		return;
+	}
+
+	wheel->armed_tick = next_tick;
+}
+
+static void timer_wheel_cascade(TimerWheel *wheel, int level) {
+	int slot = (int)(wheel->now >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+	WheelTimer *timer = wheel->slots[level][slot];
+	WheelTimer *next;
+
+	wheel->slots[level][slot] = NULL;
+	wheel->occupied[level] &= ~((uint64_t)1 << slot);
+
+	for (; timer != NULL; timer = next) {
+		next = timer->next;
+
+		timer_wheel_insert(wheel, timer);
+	}
+}
+
+// process all ticks up to and including the given tick. ticks without
+// anything to do are skipped
+static void timer_wheel_advance(TimerWheel *wheel, uint64_t target) {
+	uint64_t next_tick;
+	int level;
+	int slot;
+	WheelTimer *expired;
+	WheelTimer *timer;
+
+	while (wheel->now < target) {
+		next_tick = timer_wheel_get_next_tick(wheel);
+
+		if (next_tick == 0 || next_tick > target) {
+			wheel->now = target;
+
+			break;
+		}
+
+		wheel->now = next_tick;
+
+		// cascade higher levels whose index advanced with this tick
+		for (level = 1; level < TIMER_WHEEL_LEVEL_COUNT; ++level) {
+			if ((wheel->now & (((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0) {
+				break;
+			}
+
+			timer_wheel_cascade(wheel, level);
+		}
+
+		// move the wheel timers of the current slot to a separate expired
+		// list. a wheel timer function can reconfigure or cancel any wheel
+		// timer, including the ones on the expired list
+		slot = (int)(wheel->now & TIMER_WHEEL_SLOT_MASK);
+		expired = NULL;
+
+		while ((timer = wheel->slots[0][slot]) != NULL) {
+			timer_wheel_remove(wheel, timer);
+
+			// a wheel timer beyond the range of the wheel got cascaded
+			// down to here before its expiry, just insert it again
+			if (timer->expiry > wheel->now) {
+				timer_wheel_insert(wheel, timer);
+			} else {
+				timer_wheel_link(&expired, timer);
+			}
+		}
+
+		while ((timer = expired) != NULL) {
+			timer_wheel_unlink(timer);
+
+			if (timer->interval > 0) {
+				timer->deadline += timer->interval;
+
+				if (timer->deadline <= wheel->now) {
+					timer->deadline = wheel->now + 1;
+				}
+
+				timer->expiry = apply_time_slack(timer->deadline, timer->slack);
+
+				timer_wheel_insert(wheel, timer);
+			} else {
+				--wheel->timer_count;
+			}
+
+			// this call might reconfigure or cancel any wheel timer
+			timer->function(timer->opaque);
+		}
+	}
+}
+
+static void timer_wheel_handle_expiry(void *opaque) {
+	TimerWheel *wheel = opaque;
+
+	wheel->armed_tick = 0;
+
+	timer_wheel_advance(wheel, timer_wheel_get_tick(wheel));
+	timer_wheel_arm(wheel);
+}
+
+int timer_wheel_create(TimerWheel *wheel) {
+	memset(wheel, 0, sizeof(TimerWheel));
+
+	if (timer_create_(&wheel->timer, timer_wheel_handle_expiry, wheel) < 0) {
+		return -1;
+	}
+
+	wheel->base = microtime();
+
+	return 0;
+}
+
+void timer_wheel_destroy(TimerWheel *wheel) {
+	if (wheel->timer_count > 0) {
+		log_warn("Leaking %d pending wheel timer(s)", wheel->timer_count);
+	}
+
+	timer_destroy(&wheel->timer);
+}
+
+void timer_wheel_init_timer(TimerWheel *wheel, WheelTimer *timer,
+                            TimerFunction function, void *opaque) {
+	memset(timer, 0, sizeof(WheelTimer));
+
+	timer->wheel = wheel;
+	timer->level = -1;
+	timer->function = function;
+	timer->opaque = opaque;
+}
+
+// setting delay and interval to 0 stops the wheel timer. the underlying timer
+// is only reconfigured if the wheel timer expires before it
+int timer_wheel_configure_timer(WheelTimer *timer, uint64_t delay, uint64_t interval) { // microseconds
+	return timer_wheel_configure_timer_with_slack(timer, delay, interval, 0);
+}
+
+// the wheel timer might expire up to slack microseconds late, rounded down to
+// full ticks. this allows to merge its expirations with the expirations of
+// other wheel timers into fewer wakeups of the underlying timer
+int timer_wheel_configure_timer_with_slack(WheelTimer *timer, uint64_t delay,
+                                           uint64_t interval, uint64_t slack) { // microseconds
+	TimerWheel *wheel = timer->wheel;
+
+	timer_wheel_cancel_timer(timer);
+
+	if (delay == 0 && interval == 0) {
+		return 0;
+	}
+
+	// round up to full ticks, a wheel timer never expires early
+	timer->deadline = (microtime() - wheel->base + delay + TIMER_WHEEL_TICK_LENGTH - 1) / TIMER_WHEEL_TICK_LENGTH;
+	timer->interval = (interval + TIMER_WHEEL_TICK_LENGTH - 1) / TIMER_WHEEL_TICK_LENGTH;
+	timer->slack = slack / TIMER_WHEEL_TICK_LENGTH;
+
+	if (timer->deadline <= wheel->now) {
+		timer->deadline = wheel->now + 1;
+	}
+
+	timer->expiry = apply_time_slack(timer->deadline, timer->slack);
+
+	timer_wheel_insert(wheel, timer);
+
+	++wheel->timer_count;
+
+	if (wheel->armed_tick == 0 || timer->expiry < wheel->armed_tick) {
+		timer_wheel_arm(wheel);
+	}
+
+	// the underlying timer could not be armed. don't leave the wheel timer
+	// pending, the caller got an error reported and will not expect it to
+	// expire
+	if (wheel->armed_tick == 0) {
+		timer_wheel_cancel_timer(timer);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+void timer_wheel_cancel_timer(WheelTimer *timer) {
+	if (timer->previous_next == NULL) {
+		return;
+	}
+
+	timer_wheel_remove(timer->wheel, timer);
+
+	--timer->wheel->timer_count;
+}
@@ -0,0 +1,76 @@
+/*
+ * daemonlib
+ * Copyright (C) 2026 Matthias Bolte <matthias@tinkerforge.com>
+ *
+ * timer_wheel.h: Hierarchical timer wheel for many lightweight timers
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DAEMONLIB_TIMER_WHEEL_H
+#define DAEMONLIB_TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timer.h"
+
+#define TIMER_WHEEL_TICK_LENGTH 1000 // microseconds
+#define TIMER_WHEEL_LEVEL_COUNT 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOT_COUNT (1 << TIMER_WHEEL_SLOT_BITS)
+
+typedef struct _TimerWheel TimerWheel;
+typedef struct _WheelTimer WheelTimer;
+
+// a lightweight timer that is allocated by the caller, e.g. embedded into a
+// client struct. its expiry is rounded up to the next tick of the timer wheel
+struct _WheelTimer {
+	TimerWheel *wheel;
+	WheelTimer *next; // in slot or expired list
+	WheelTimer **previous_next; // next pointer of the previous timer or list head
+	int level; // -1 if not in a slot
+	int slot;
+	uint64_t deadline; // in ticks
+	uint64_t expiry; // in ticks, deadline with slack applied
+	uint64_t interval; // in ticks, 0 if not repeated
+	uint64_t slack; // in ticks
+	TimerFunction function;
+	void *opaque;
+};
+
+// all wheel timers of a timer wheel share a single underlying timer. the
+// timer wheel is bound to the event loop that was current on creation
+struct _TimerWheel {
+	Timer timer;
+	uint64_t base; // microtime of tick 0
+	uint64_t now; // all ticks up to and including this one got processed
+	uint64_t armed_tick; // tick the underlying timer is armed for, 0 if not armed
+	WheelTimer *slots[TIMER_WHEEL_LEVEL_COUNT][TIMER_WHEEL_SLOT_COUNT];
+	uint64_t occupied[TIMER_WHEEL_LEVEL_COUNT]; // bitmask of non-empty slots
+	int timer_count; // number of pending wheel timers
+};
+
+int timer_wheel_create(TimerWheel *wheel);
+void timer_wheel_destroy(TimerWheel *wheel);
+
+void timer_wheel_init_timer(TimerWheel *wheel, WheelTimer *timer,
+                            TimerFunction function, void *opaque);
+int timer_wheel_configure_timer(WheelTimer *timer, uint64_t delay, uint64_t interval); // microseconds
+int timer_wheel_configure_timer_with_slack(WheelTimer *timer, uint64_t delay,
+                                           uint64_t interval, uint64_t slack); // microseconds
+void timer_wheel_cancel_timer(WheelTimer *timer);
+
+#endif // DAEMONLIB_TIMER_WHEEL_H
@@ -31,6 +31,16 @@
 #include "threads.h"
 
 typedef void (*TimerFunction)(void *opaque);
+typedef void (*TimerOverrunFunction)(void *opaque, uint64_t missed);
+
+// the lateness is the time between the scheduled expiration and the handling
+// of the latest expiration, accumulated over all handlings of the timer
+typedef struct {
+	uint64_t handled; // number of times the timer function was called
+	uint64_t missed; // expirations that were not handled individually
+	uint64_t total_lateness; // in microseconds
+	uint64_t max_lateness; // in microseconds
+} TimerStats;
 
 typedef struct {
 	Pipe notification_pipe;
@@ -42,8 +52,11 @@ typedef struct {
 	uint64_t delay; // in microseconds
 	uint64_t interval; // in microseconds
 	uint32_t configuration_id;
+	uint64_t next_expiry; // microtime, 0 if not armed
 	TimerFunction function;
+	TimerOverrunFunction overrun_function;
 	void *opaque;
+	TimerStats stats;
 } Timer;
 
 #endif // DAEMONLIB_TIMER_WINAPI_H
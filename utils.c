@@ -577,6 +577,57 @@ uint64_t millitime(void) { // monotonic
 	return microtime() / 1000;
 }
 
+uint64_t realtime_microtime(void) { // since the Unix epoch, not monotonic
+#ifdef _WIN32
+	FILETIME ft;
+	uint64_t time;
+
+	GetSystemTimeAsFileTime(&ft); // cannot fail
+
+	// FILETIME counts 100 nanoseconds since 1601-01-01
+	time = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+
+	return (time - 116444736000000000ULL) / 10;
+#else
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL); // cannot fail under normal circumstances
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+// move the time to the latest multiple of the largest power of 2 that still
+// lies within the slack. timers with overlapping slack windows tend to end up
+// on the same multiple and expire together
+uint64_t apply_time_slack(uint64_t time, uint64_t slack) {
+	uint64_t limit = time + slack;
+	uint64_t mask = time ^ limit;
+	int bit = 0;
+
+	if (slack == 0) {
+		return time;
+	}
+
+	while ((mask >>= 1) != 0) {
+		++bit;
+	}
+
+	return limit & ~(((uint64_t)1 << bit) - 1);
+}
+
+// returns the first time after now that lies on a multiple of the interval,
+// shifted by the offset
+uint64_t get_aligned_time(uint64_t now, uint64_t interval, uint64_t offset) {
+	offset %= interval;
+
+	if (now < offset) {
+		return offset;
+	}
+
+	return now + interval - (now - offset) % interval;
+}
+
 #if !defined _GNU_SOURCE && !defined __APPLE__ && !defined __ANDROID__
 
 #include <ctype.h>
@@ -57,6 +57,10 @@ void millisleep(uint32_t duration);
 
 uint64_t microtime(void);
 uint64_t millitime(void);
+uint64_t realtime_microtime(void);
+
+uint64_t apply_time_slack(uint64_t time, uint64_t slack);
+uint64_t get_aligned_time(uint64_t now, uint64_t interval, uint64_t offset);
 
 #if !defined _GNU_SOURCE && !defined __APPLE__ && !defined __ANDROID__
 char *strcasestr(const char *haystack, const char *needle);